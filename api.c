@@ -0,0 +1,400 @@
+/* The public interface of libscrutineer.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+
+scrutineer_t *scrutineer_new(void) {
+    scrutineer_t *s = (scrutineer_t*)calloc(1, sizeof(scrutineer_t));
+
+    if (s) {
+        s->seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+        s->marker = -1;
+        s->gone = -1;
+        s->workers = 1;
+    }
+    return s;
+}
+
+static void free_list(list_t *p) {
+    while (p) {
+        list_t *next = p->next;
+        free((char*)p->value);
+        free(p->found.items);
+        free(p);
+        p = next;
+    }
+}
+
+/* Free a split command. Only the first n words are ours. */
+static void free_command(char **argv, unsigned int n) {
+    unsigned int i;
+
+    if (!argv)
+        return;
+    for (i = 0; i < n && argv[i]; ++i)
+        free(argv[i]);
+    free(argv);
+}
+
+void scrutineer_free(scrutineer_t *s) {
+    size_t i;
+
+    if (!s)
+        return;
+    restore_times(s);
+    unstage(s);
+    free(s->saved);
+    free_index(&s->index);
+    close_marker(s);
+    close_dirs(&s->dir_fds);
+    free_command(s->build, s->target_arg);
+    free_command(s->clean, UINT_MAX);
+    free_list(s->targets);
+    free_list(s->dependencies);
+    for (i = 0; i < s->makefiles.count; ++i)
+        free((char*)s->makefiles.items[i]);
+    free(s->makefiles.items);
+    free(s->shim);
+    close_journal(&s->journal);
+    free(s->journal_path);
+    free_profile(&s->profile);
+    free(s->profile_path);
+    free(s);
+}
+
+void scrutineer_restore(scrutineer_t *s) {
+    restore_times(s);
+}
+
+const char *scrutineer_error(const scrutineer_t *s) {
+    return s->error;
+}
+
+int scrutineer_set_backend(scrutineer_t *s, const char *name) {
+    ENTER(s);
+    s->backend = find_backend(name);
+    if (!s->backend)
+        DIE("Unknown backend %s.\n", name);
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_set_build(scrutineer_t *s, const char *command) {
+    ENTER(s);
+    if (s->build)
+        DIE("Multiple build actions specified.\n");
+    s->build = with_target(split(command), &s->target_arg);
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_set_clean(scrutineer_t *s, const char *command) {
+    ENTER(s);
+    if (s->clean)
+        DIE("Multiple clean actions specified.\n");
+    s->clean = split(command);
+    LEAVE();
+    return 0;
+}
+
+/* Add a copy of value to the front of a list. */
+static void push(list_t **list, const char *value) {
+    list_t *temp = (list_t*)calloc(1, sizeof(list_t));
+
+    if (!temp || !(temp->value = strdup(value)))
+        DIE("Out of memory.\n");
+    temp->next = *list;
+    *list = temp;
+}
+
+int scrutineer_add_target(scrutineer_t *s, const char *target) {
+    ENTER(s);
+    push(&s->targets, target);
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_add_candidate(scrutineer_t *s, const char *path) {
+    ENTER(s);
+    push(&s->dependencies, path);
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_add_makefile(scrutineer_t *s, const char *path) {
+    char *copy;
+
+    ENTER(s);
+    copy = strdup(path);
+    if (!copy)
+        DIE("Out of memory.\n");
+    append(&s->makefiles, copy);
+    LEAVE();
+    return 0;
+}
+
+void scrutineer_set_strategy(scrutineer_t *s, unsigned int strategy) {
+    s->strategy = strategy;
+}
+
+void scrutineer_set_sample(scrutineer_t *s, unsigned int n) {
+    s->sample = n;
+}
+
+void scrutineer_set_budget(scrutineer_t *s, unsigned int seconds) {
+    s->budget = seconds;
+}
+
+void scrutineer_set_estimate(scrutineer_t *s, unsigned int n) {
+    s->estimate = n;
+}
+
+void scrutineer_set_side_outputs(scrutineer_t *s, int enable) {
+    s->side_outputs = enable;
+}
+
+void scrutineer_set_workers(scrutineer_t *s, unsigned int n) {
+    s->workers = n ? n : 1;
+}
+
+void scrutineer_set_adaptive(scrutineer_t *s, int enable,
+        unsigned int max_load, unsigned int max_stall) {
+    s->adaptive = enable;
+    s->max_load = max_load;
+    s->max_stall = max_stall;
+}
+
+void scrutineer_set_timeout(scrutineer_t *s, unsigned int seconds,
+        unsigned int retries) {
+    s->timeout = seconds;
+    s->retries = retries;
+}
+
+int scrutineer_set_shim(scrutineer_t *s, const char *path) {
+    ENTER(s);
+    free(s->shim);
+    s->shim = strdup(path);
+    if (!s->shim)
+        DIE("Out of memory.\n");
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_stage(scrutineer_t *s, const char *dir) {
+    ENTER(s);
+    stage(s, dir);
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_set_journal(scrutineer_t *s, const char *path, int resume) {
+    ENTER(s);
+    free(s->journal_path);
+    s->journal_path = from_home(s, path);
+    s->resume = resume;
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_set_profile(scrutineer_t *s, const char *path) {
+    ENTER(s);
+    free(s->profile_path);
+    s->profile_path = from_home(s, path);
+    read_profile(s);
+    LEAVE();
+    return 0;
+}
+
+void scrutineer_on_edge(scrutineer_t *s, scrutineer_edge_fn fn, void *data) {
+    s->on_edge = fn;
+    s->edge_data = data;
+}
+
+void scrutineer_on_progress(scrutineer_t *s, scrutineer_progress_fn fn,
+        void *data) {
+    s->on_progress = fn;
+    s->progress_data = data;
+}
+
+/* Check all the candidates we were given actually exist. */
+static void check_candidates(const scrutineer_t *s) {
+    const list_t *p;
+
+    for (p = s->dependencies; p; p = p->next) {
+        assert(p->value);
+        if (!exists(p->value))
+            DIE("Component %s doesn't exist after cleaning. "
+                "Is it an intermediate file?\n", p->value);
+    }
+}
+
+int scrutineer_run(scrutineer_t *s) {
+    list_t *p;
+
+    ENTER(s);
+    /* The journal has to see the candidates before we touch anything. */
+    if (s->journal_path && !s->journal.file)
+        open_journal(s, s->journal_path, s->resume);
+    prepare(s);
+    check_candidates(s);
+    start_clock(s);
+    for (p = s->targets; p; p = p->next)
+        if (!journal_resume(s, p))
+            assess(s, p);
+    report_unassessed(s);
+    restore_times(s);
+    write_profile(s);
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_run_since(scrutineer_t *s, const char *range,
+        const char *graph) {
+    char *path;
+
+    ENTER(s);
+    prepare(s);
+    check_candidates(s);
+    start_clock(s);
+    path = from_home(s, graph);
+    assess_changes(s, range, path);
+    free(path);
+    report_unassessed(s);
+    restore_times(s);
+    write_profile(s);
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_run_reverse(scrutineer_t *s) {
+    ENTER(s);
+    prepare(s);
+    check_candidates(s);
+    if (!s->dependencies)
+        DIE("No files to touch.\n");
+    reverse(s);
+    restore_times(s);
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_check_parallel(scrutineer_t *s, unsigned int jobs,
+        unsigned int rounds, unsigned int jitter) {
+    ENTER(s);
+    if (jobs < 2)
+        DIE("The parallel check needs at least 2 jobs.\n");
+    if (rounds == 0)
+        DIE("The parallel check needs at least 1 round.\n");
+    prepare(s);
+    /* It runs make -jN with our shim as SHELL to jitter the recipes, which
+     * other build systems would take for a target.
+     */
+    if (strcmp(s->backend->name, "make"))
+        DIE("The parallel check only works with make, not %s.\n",
+            s->backend->name);
+    check_parallel(s, jobs, rounds, jitter);
+    write_profile(s);
+    LEAVE();
+    return 0;
+}
+
+int scrutineer_watch(scrutineer_t *s) {
+    ENTER(s);
+#ifdef __linux__
+    if (s->stage)
+        DIE("Watching a staged copy of the working directory would miss "
+            "changes to the original.\n");
+    prepare(s);
+    watch(s);
+#else
+    DIE("Watching is only supported on Linux.\n");
+#endif
+    LEAVE();
+    return -1;
+}
+
+int scrutineer_save(scrutineer_t *s, const char *path) {
+    list_t *p;
+    char *saved;
+
+    ENTER(s);
+    prepare(s);
+    /* Fingerprint the rules we used so a later run can tell whether they
+     * changed.
+     */
+    if (s->backend->fingerprint)
+        for (p = s->targets; p; p = p->next)
+            if (!p->fingerprint)
+                p->fingerprint = s->backend->fingerprint(s->build,
+                    s->target_arg, p->value);
+    saved = from_home(s, path);
+    save_graph(saved, s->targets, s->dependencies);
+    free(saved);
+    LEAVE();
+    return 0;
+}
+
+size_t scrutineer_target_count(const scrutineer_t *s) {
+    const list_t *p;
+    size_t n = 0;
+
+    for (p = s->targets; p; p = p->next)
+        ++n;
+    return n;
+}
+
+const char *scrutineer_target(const scrutineer_t *s, size_t index) {
+    const list_t *p;
+
+    for (p = s->targets; p && index > 0; p = p->next)
+        --index;
+    return p ? p->value : NULL;
+}
+
+scrutineer_status_t scrutineer_status(const scrutineer_t *s,
+        const char *target) {
+    const list_t *p = find_target((list_t*)s->targets, target);
+
+    if (!p || !p->assessed)
+        return SCRUTINEER_UNASSESSED;
+    if (p->phony)
+        return SCRUTINEER_PHONY;
+    if (p->dirty)
+        return SCRUTINEER_DIRTY;
+    if (p->failed)
+        return SCRUTINEER_FAILED;
+    return SCRUTINEER_ASSESSED;
+}
+
+const char *const *scrutineer_dependencies(const scrutineer_t *s,
+        const char *target, size_t *count) {
+    const list_t *p = find_target((list_t*)s->targets, target);
+
+    if (!p) {
+        *count = 0;
+        return NULL;
+    }
+    *count = p->found.count;
+    return p->found.items;
+}
+
+int scrutineer_affected(const scrutineer_t *s, const char *target) {
+    const list_t *p = find_target((list_t*)s->targets, target);
+
+    return p && p->affected;
+}
+
+const scrutineer_estimate_t *scrutineer_estimate(const scrutineer_t *s,
+        const char *target) {
+    const list_t *p = find_target((list_t*)s->targets, target);
+
+    return p && p->estimated ? &p->estimate : NULL;
+}
@@ -0,0 +1,389 @@
+/* The build systems we know how to drive.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+/* A dry run tells us whether Ninja has any work to do for the target. When
+ * it does, we can't be sure the target itself would be rebuilt (a restat
+ * rule may stop the rebuild propagating), so a real build has to decide.
+ */
+static int ninja_query(char *const *tool, unsigned int tool_len,
+        const char *target) {
+    const char *args[] = { "-n", target };
+    char **argv, *out;
+    int ret;
+
+    argv = command(tool, tool_len, args, 2);
+    out = run_output(argv);
+    ret = !out || !strstr(out, "ninja: no work to do.");
+    free(out);
+    free(argv);
+    return ret;
+}
+
+/* Parse the output of `ninja -t deps` into d. */
+static void parse_ninja_deps(const char *out, depfiles_t *d) {
+    char *target = NULL, **prereqs = NULL;
+    size_t n = 0, i;
+
+    for (;;) {
+        const char *end = strchr(out, '\n');
+        size_t len = end ? (size_t)(end - out) : strlen(out);
+
+        if (len > 0 && out[0] != ' ') {
+            /* A new target, "main.o: #deps 2, deps mtime 123 (VALID)". */
+            const char *colon = strstr(out, ": #deps");
+
+            if (target)
+                add_rule(d, target, prereqs, n);
+            free(target);
+            for (i = 0; i < n; ++i)
+                free(prereqs[i]);
+            n = 0;
+            target = colon && colon < out + len ?
+                strndup(out, colon - out) : NULL;
+        } else if (len > 0 && target) {
+            const char *s = out;
+
+            while (*s == ' ')
+                ++s;
+            prereqs = (char**)realloc(prereqs, sizeof(char*) * (n + 1));
+            if (!prereqs)
+                DIE("Out of memory.\n");
+            prereqs[n++] = strndup(s, out + len - s);
+        }
+        if (!end)
+            break;
+        out = end + 1;
+    }
+    if (target)
+        add_rule(d, target, prereqs, n);
+    free(target);
+    for (i = 0; i < n; ++i)
+        free(prereqs[i]);
+    free(prereqs);
+}
+
+/* Parse the output of `ninja -t query` into d, returning the explicit and
+ * implicit inputs we found so the caller can query them in turn.
+ */
+static char **parse_ninja_query(const char *out, depfiles_t *d,
+        size_t *ninputs) {
+    char *target = NULL, **prereqs = NULL, **inputs = NULL;
+    size_t n = 0, i;
+    int in_inputs = 0;
+
+    *ninputs = 0;
+    for (;;) {
+        const char *end = strchr(out, '\n');
+        size_t len = end ? (size_t)(end - out) : strlen(out);
+        size_t indent = strspn(out, " ");
+
+        if (len > 0 && indent == 0 && out[len - 1] == ':') {
+            /* "target:" starts a new node. */
+            if (target)
+                add_rule(d, target, prereqs, n);
+            free(target);
+            for (i = 0; i < n; ++i)
+                free(prereqs[i]);
+            n = 0;
+            target = strndup(out, len - 1);
+            in_inputs = 0;
+        } else if (indent == 2) {
+            /* "  input: rule" or "  outputs:". */
+            in_inputs = !strncmp(out + 2, "input:", 6);
+        } else if (indent == 4 && in_inputs && target) {
+            const char *s = out + 4;
+            size_t slen = len - 4;
+
+            /* Order-only inputs ("|| x") and validations ("|@ x") don't cause
+             * a rebuild; implicit inputs ("| x") do.
+             */
+            if (slen >= 2 && s[0] == '|' && (s[1] == '|' || s[1] == '@'))
+                goto next;
+            if (slen >= 2 && s[0] == '|' && s[1] == ' ') {
+                s += 2;
+                slen -= 2;
+            }
+            prereqs = (char**)realloc(prereqs, sizeof(char*) * (n + 1));
+            inputs = (char**)realloc(inputs,
+                sizeof(char*) * (*ninputs + 1));
+            if (!prereqs || !inputs)
+                DIE("Out of memory.\n");
+            prereqs[n++] = strndup(s, slen);
+            inputs[(*ninputs)++] = strndup(s, slen);
+        }
+next:
+        if (!end)
+            break;
+        out = end + 1;
+    }
+    if (target)
+        add_rule(d, target, prereqs, n);
+    free(target);
+    for (i = 0; i < n; ++i)
+        free(prereqs[i]);
+    free(prereqs);
+    return inputs;
+}
+
+/* Ninja knows the declared inputs of every build edge and records the
+ * headers each compile read in its deps log. We walk the graph from target a
+ * level at a time, asking about each level in one go.
+ */
+static void ninja_known(char *const *tool, unsigned int tool_len,
+        const char *target, depfiles_t *d) {
+    const char **frontier, **seen = NULL;
+    size_t nfrontier = 1, nseen = 0, i;
+
+    frontier = (const char**)malloc(sizeof(char*));
+    if (!frontier)
+        DIE("Out of memory.\n");
+    frontier[0] = strdup(target);
+
+    while (nfrontier > 0) {
+        const char **args, **next = NULL;
+        char **argv, *out, **inputs;
+        size_t nnext = 0, ninputs;
+
+        args = (const char**)malloc(sizeof(char*) * (nfrontier + 2));
+        if (!args)
+            DIE("Out of memory.\n");
+        args[0] = "-t";
+        for (i = 0; i < nfrontier; ++i)
+            args[i + 2] = frontier[i];
+
+        args[1] = "deps";
+        argv = command(tool, tool_len, args, nfrontier + 2);
+        out = run_output(argv);
+        if (out)
+            parse_ninja_deps(out, d);
+        free(out);
+        free(argv);
+
+        args[1] = "query";
+        argv = command(tool, tool_len, args, nfrontier + 2);
+        out = run_output(argv);
+        inputs = out ? parse_ninja_query(out, d, &ninputs) : NULL;
+        if (!out)
+            ninputs = 0;
+        free(out);
+        free(argv);
+        free(args);
+
+        /* Anything we haven't asked about yet goes in the next level. */
+        for (i = 0; i < nfrontier; ++i) {
+            seen = (const char**)realloc(seen, sizeof(char*) * (nseen + 1));
+            if (!seen)
+                DIE("Out of memory.\n");
+            seen[nseen++] = frontier[i];
+        }
+        qsort(seen, nseen, sizeof(char*), compare_strings);
+        for (i = 0; i < ninputs; ++i) {
+            const char *key = inputs[i];
+            size_t j;
+            int dup = 0;
+
+            if (bsearch(&key, seen, nseen, sizeof(char*), compare_strings))
+                dup = 1;
+            for (j = 0; !dup && j < nnext; ++j)
+                dup = !strcmp(next[j], key);
+            if (dup) {
+                free(inputs[i]);
+                continue;
+            }
+            next = (const char**)realloc(next, sizeof(char*) * (nnext + 1));
+            if (!next)
+                DIE("Out of memory.\n");
+            next[nnext++] = inputs[i];
+        }
+        free(inputs);
+        free(frontier);
+        frontier = next;
+        nfrontier = nnext;
+    }
+
+    for (i = 0; i < nseen; ++i)
+        free((char*)seen[i]);
+    free(seen);
+    free(frontier);
+}
+
+/* Ninja's graph is exact, so what it knows is all that is reachable and
+ * all that decides whether target is rebuilt.
+ */
+static int ninja_reachable(char *const *tool, unsigned int tool_len,
+        const char *target, depfiles_t *d) {
+    ninja_known(tool, tool_len, target, d);
+    return 0;
+}
+
+/* Make's database after a dry run has every rule it used to decide whether
+ * target is up to date, including the implicit ones.
+ */
+static int make_reachable(char *const *tool, unsigned int tool_len,
+        const char *target, depfiles_t *d) {
+    database_t db;
+    int ret;
+
+    if (read_database(tool, tool_len, &target, 1, &db))
+        return -1;
+    ret = reachable_rules(&db, target, d);
+    free_database(&db);
+    return ret;
+}
+
+/* The same database, taken literally. */
+static int make_graph(char *const *tool, unsigned int tool_len,
+        const char *target, depfiles_t *d) {
+    database_t db;
+    int ret;
+
+    if (read_database(tool, tool_len, &target, 1, &db))
+        return -1;
+    ret = rule_graph(&db, target, d);
+    free_database(&db);
+    return ret;
+}
+
+/* Run tool with the given arguments and hash its output, or only the lines
+ * containing filter if it is not NULL. Returns 0 on failure.
+ */
+static uint64_t hash_output(char *const *tool, unsigned int tool_len,
+        const char *const *args, unsigned int nargs, const char *filter) {
+    char **argv, *out, *line, *end;
+    uint64_t h = HASH_SEED;
+
+    argv = command(tool, tool_len, args, nargs);
+    out = run_output(argv);
+    free(argv);
+    if (!out)
+        return 0;
+    for (line = out; *line; line = end + 1) {
+        end = strchr(line, '\n');
+        if (!end)
+            end = line + strlen(line) - 1;
+        else
+            *end = '\0';
+        if (!filter || strstr(line, filter))
+            h = hash_bytes(h, line, strlen(line) + 1);
+    }
+    free(out);
+    return h ? h : 1;
+}
+
+/* Make's dry run with -B gives us every recipe needed to build target from
+ * scratch, but not prerequisites that have no recipe of their own. Make's
+ * debug output has those as the files it considers, indented by depth.
+ */
+static uint64_t make_fingerprint(char *const *tool, unsigned int tool_len,
+        const char *target) {
+    const char *recipes[] = { "-n", "-B", target };
+    const char *files[] = { "-n", "-B", "-d", target };
+    uint64_t a, b, h;
+
+    a = hash_output(tool, tool_len, recipes, 3, NULL);
+    b = hash_output(tool, tool_len, files, 4, "Considering target file");
+    if (!a || !b)
+        return 0;
+    h = a ^ (b * 0x9e3779b97f4a7c15ULL);
+    return h ? h : 1;
+}
+
+/* Ninja's commands include their inputs, so they are enough for us. */
+static uint64_t ninja_fingerprint(char *const *tool, unsigned int tool_len,
+        const char *target) {
+    const char *args[] = { "-t", "commands", target };
+
+    return hash_output(tool, tool_len, args, 3, NULL);
+}
+
+/* Run tool with the given arguments and return its output. */
+static char *tool_output(char *const *tool, unsigned int tool_len,
+        const char *const *args, unsigned int nargs) {
+    char **argv = command(tool, tool_len, args, nargs);
+    char *out = run_output(argv);
+
+    free(argv);
+    return out;
+}
+
+static char *make_recipe(char *const *tool, unsigned int tool_len,
+        const char *target) {
+    const char *args[] = { "-n", "-B", target };
+
+    return tool_output(tool, tool_len, args, 3);
+}
+
+static char *ninja_recipe(char *const *tool, unsigned int tool_len,
+        const char *target) {
+    const char *args[] = { "-t", "commands", target };
+
+    return tool_output(tool, tool_len, args, 3);
+}
+
+/* Every target in make's database with a recipe of its own. Pattern rules
+ * and special targets are left out.
+ */
+static int make_targets(char *const *tool, unsigned int tool_len,
+        strings_t *targets) {
+    database_t db;
+    size_t i;
+
+    if (read_database(tool, tool_len, NULL, 0, &db))
+        return -1;
+    for (i = 0; i < db.recipes.count; ++i) {
+        const char *t = db.recipes.items[i];
+
+        if (t[0] != '.' && !strchr(t, '%') && !contains(targets, t))
+            append(targets, strdup(t));
+    }
+    free_database(&db);
+    return 0;
+}
+
+/* "ninja -t targets all" lists every output with the rule that builds it.
+ * Phony ones are not files.
+ */
+static int ninja_targets(char *const *tool, unsigned int tool_len,
+        strings_t *targets) {
+    const char *args[] = { "-t", "targets", "all" };
+    char *out = tool_output(tool, tool_len, args, 3), *line;
+
+    if (!out)
+        return -1;
+    for (line = strtok(out, "\n"); line; line = strtok(NULL, "\n")) {
+        char *colon = strrchr(line, ':');
+
+        if (colon && strcmp(colon, ": phony")) {
+            *colon = '\0';
+            append(targets, strdup(line));
+        }
+    }
+    free(out);
+    return 0;
+}
+
+static const backend_t backends[] = {
+    { "make", DEFAULT_BUILD, DEFAULT_CLEAN, NULL, NULL, make_reachable,
+        make_graph, make_fingerprint, make_recipe, make_targets },
+    { "ninja", "ninja", "ninja -t clean", ninja_query, ninja_known,
+        ninja_reachable, ninja_reachable, ninja_fingerprint, ninja_recipe,
+        ninja_targets },
+};
+
+/* Look up a backend by name. */
+const backend_t *find_backend(const char *name) {
+    size_t i;
+
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i)
+        if (!strcmp(backends[i].name, name))
+            return &backends[i];
+    return NULL;
+}
+
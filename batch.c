@@ -0,0 +1,413 @@
+/* Looking at and touching many files at once. With tens of thousands of
+ * candidates, doing them one at a time costs more than the builds.
+ *
+ * Looking at files goes through io_uring on Linux, so the kernel works
+ * through a batch of statx calls without a system call each. Where that's
+ * not available, and for touching files, which io_uring can't do, the
+ * files are shared between a few threads.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "internal.h"
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+        /* IORING_OP_STATX is an enum, but headers that have this have it. */
+        #if defined(IORING_FEAT_FAST_POLL) && defined(STATX_BASIC_STATS)
+            #define HAVE_IO_URING
+            #include <sys/mman.h>
+            #include <sys/syscall.h>
+        #endif
+    #endif
+#endif
+
+/* The most threads to share files between, and the fewest files worth
+ * starting another one for.
+ */
+#define MAX_THREADS 16
+#define FILES_PER_THREAD 256
+
+/* A range of the files for one thread to deal with. */
+typedef struct {
+    void (*fn)(void *data, size_t i);
+    void *data;
+    size_t from, to;
+} share_t;
+
+static void *do_share(void *arg) {
+    const share_t *share = (const share_t*)arg;
+    size_t i;
+
+    for (i = share->from; i < share->to; ++i)
+        share->fn(share->data, i);
+    return NULL;
+}
+
+/* Call fn(data, i) for each i below n, across as many threads as are worth
+ * it. fn must not DIE.
+ */
+static void share_out(size_t n, void (*fn)(void *data, size_t i),
+        void *data) {
+    pthread_t threads[MAX_THREADS];
+    share_t shares[MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = n / FILES_PER_THREAD + 1, started = 0, i;
+
+    if (cpus > 0 && nthreads > (size_t)cpus)
+        nthreads = (size_t)cpus;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+    for (i = 0; i < nthreads; ++i) {
+        shares[i].fn = fn;
+        shares[i].data = data;
+        shares[i].from = n * i / nthreads;
+        shares[i].to = n * (i + 1) / nthreads;
+    }
+
+    /* This thread takes the first share, and any a thread couldn't be
+     * started for.
+     */
+    for (i = 1; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, do_share, &shares[i]))
+            break;
+        ++started;
+    }
+    do_share(&shares[0]);
+    for (i = 1 + started; i < nthreads; ++i)
+        do_share(&shares[i]);
+    for (i = 1; i <= started; ++i)
+        pthread_join(threads[i], NULL);
+}
+
+#ifdef STATX_BASIC_STATS
+#define STATX_WANTED (STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME)
+#define STATX_FLAGS (AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC)
+
+static void from_statx(meta_t *m, const struct statx *stx) {
+    m->ino = stx->stx_ino;
+    m->size = stx->stx_size;
+    m->mtime.tv_sec = stx->stx_mtime.tv_sec;
+    m->mtime.tv_nsec = stx->stx_mtime.tv_nsec;
+    m->ctime.tv_sec = stx->stx_ctime.tv_sec;
+    m->ctime.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+#endif
+
+/* Look at one file, noting whether it is there. */
+static void look(void *data, size_t i) {
+    meta_t *m = &((meta_t*)data)[i];
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+
+    /* statx lets us ask for only what we use, which is cheaper on some
+     * filesystems.
+     */
+    m->present = !statx(AT_FDCWD, m->path, STATX_FLAGS, STATX_WANTED, &stx);
+    if (m->present)
+        from_statx(m, &stx);
+#else
+    struct stat st;
+
+    m->present = !lstat(m->path, &st);
+    if (m->present) {
+        m->ino = st.st_ino;
+        m->size = st.st_size;
+        m->mtime = st.st_mtim;
+        m->ctime = st.st_ctim;
+    }
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/* How many operations to have in flight at once. */
+#define RING_ENTRIES 256
+
+/* An io_uring, set up with the bare system calls. */
+typedef struct {
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+} uring_t;
+
+static void close_ring(uring_t *r) {
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_size);
+    if (r->sq_ring)
+        munmap(r->sq_ring, r->sq_size);
+    close(r->fd);
+}
+
+/* Returns 0 on success or -1 if we can't have a ring. */
+static int open_ring(uring_t *r) {
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_size > r->sq_size)
+        r->sq_size = r->cq_size;
+    r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        close_ring(r);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ring = r->sq_ring;
+    else {
+        r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            close_ring(r);
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+        IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        close_ring(r);
+        return -1;
+    }
+
+    sq = (char*)r->sq_ring;
+    cq = (char*)r->cq_ring;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->entries = p.sq_entries;
+    return 0;
+}
+
+/* Look at every file through a ring. Returns 0 on success or -1 if the
+ * kernel turned out not to support it, and they need looking at another way.
+ */
+static int look_with_ring(meta_t *entries, size_t n) {
+    struct statx *stx;
+    size_t *owner;
+    unsigned *free_slots, nfree, i;
+    uring_t r;
+    size_t submitted = 0, done = 0;
+    unsigned in_flight = 0;
+    int ret = 0;
+
+    if (n == 0)
+        return 0;
+    if (open_ring(&r))
+        return -1;
+
+    /* Each operation in flight has a slot of its own, with a statx buffer
+     * and a note of which entry it is for. Operations finish in any order,
+     * so the free slots are kept on a stack.
+     */
+    stx = (struct statx*)malloc(sizeof(struct statx) * r.entries);
+    owner = (size_t*)malloc(sizeof(size_t) * r.entries);
+    free_slots = (unsigned*)malloc(sizeof(unsigned) * r.entries);
+    if (!stx || !owner || !free_slots) {
+        free(stx);
+        free(owner);
+        free(free_slots);
+        close_ring(&r);
+        DIE("Out of memory.\n");
+    }
+    for (i = 0; i < r.entries; ++i)
+        free_slots[i] = r.entries - 1 - i;
+    nfree = r.entries;
+
+    while (done < n && ret == 0) {
+        unsigned tail = *r.sq_tail, head, to_submit = 0;
+
+        /* Fill the ring up. */
+        while (submitted < n && nfree > 0) {
+            unsigned slot = free_slots[--nfree];
+            unsigned index = tail & *r.sq_mask;
+            struct io_uring_sqe *sqe = &r.sqes[index];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)entries[submitted].path;
+            sqe->len = STATX_WANTED;
+            sqe->off = (unsigned long)&stx[slot];
+            sqe->statx_flags = STATX_FLAGS;
+            sqe->user_data = slot;
+            owner[slot] = submitted;
+            r.sq_array[index] = index;
+            ++tail;
+            ++submitted;
+            ++in_flight;
+            ++to_submit;
+        }
+        __atomic_store_n(r.sq_tail, tail, __ATOMIC_RELEASE);
+
+        if (syscall(__NR_io_uring_enter, r.fd, to_submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            ret = -1;
+            break;
+        }
+
+        /* Reap what has finished. */
+        head = *r.cq_head;
+        while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+            unsigned slot = (unsigned)cqe->user_data;
+            meta_t *m = &entries[owner[slot]];
+
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                /* Too old a kernel to do statx this way. */
+                ret = -1;
+            } else {
+                m->present = cqe->res == 0;
+                if (m->present)
+                    from_statx(m, &stx[slot]);
+            }
+            free_slots[nfree++] = slot;
+            ++head;
+            ++done;
+            --in_flight;
+        }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    /* Don't free the buffers out from under anything still in flight. */
+    while (in_flight > 0 && syscall(__NR_io_uring_enter, r.fd, 0, in_flight,
+            IORING_ENTER_GETEVENTS, NULL, 0) >= 0) {
+        unsigned head = *r.cq_head;
+
+        while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+            ++head;
+            --in_flight;
+        }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+    close_ring(&r);
+    free(stx);
+    free(owner);
+    free(free_slots);
+    return ret;
+}
+#endif
+
+/* Look at every file, filling in what we know about each. */
+void stat_all(meta_t *entries, size_t n) {
+#ifdef HAVE_IO_URING
+    /* The kernel hands statx on a ring to its own worker threads, which
+     * only pays off when they can run alongside each other.
+     */
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1 && n >= FILES_PER_THREAD &&
+            !look_with_ring(entries, n))
+        return;
+#endif
+    share_out(n, look, entries);
+}
+
+/* What to touch files with. */
+typedef struct {
+    const at_t *at;
+    struct timespec times[2];
+    int *errors;
+} touching_t;
+
+static void touch_one(void *data, size_t i) {
+    touching_t *t = (touching_t*)data;
+
+    t->errors[i] = utimensat(t->at[i].fd, t->at[i].leaf, t->times, 0) ?
+        errno : 0;
+}
+
+/* Set the access and modification times of n files, as touch does, putting
+ * 0 or the errno for each in errors if it isn't NULL.
+ */
+void touch_all(const char *const *paths, size_t n, time_t timestamp,
+        int *errors) {
+    touching_t t;
+    at_t *at;
+    size_t i;
+
+    /* Only this thread can get at the directories we keep open. */
+    at = (at_t*)malloc(sizeof(at_t) * (n ? n : 1));
+    if (!at)
+        DIE("Out of memory.\n");
+    for (i = 0; i < n; ++i)
+        at[i] = path_at(paths[i]);
+    t.at = at;
+    t.times[0].tv_sec = t.times[1].tv_sec = timestamp;
+    t.times[0].tv_nsec = t.times[1].tv_nsec = 0;
+    t.errors = errors ? errors : (int*)malloc(sizeof(int) * (n ? n : 1));
+    if (!t.errors) {
+        free(at);
+        DIE("Out of memory.\n");
+    }
+    share_out(n, touch_one, &t);
+
+    /* Anything missing may be in a directory that was replaced, and
+     * candidates we touch need noting, which again only this thread can do.
+     */
+    for (i = 0; i < n; ++i)
+        if (t.errors[i] == ENOENT && path_moved(paths[i], &at[i]))
+            t.errors[i] = touch(paths[i], timestamp) ? errno : 0;
+        else if (!t.errors[i])
+            note_stamp(paths[i], timestamp);
+    free(at);
+    if (!errors)
+        free(t.errors);
+}
+
+/* Touch every file in a list, as touch_all. Returns the errors, one for
+ * each file in turn, which the caller has to free.
+ */
+int *touch_list(const list_t *files, time_t timestamp) {
+    const char **paths = NULL;
+    const list_t *p;
+    size_t n = 0;
+    int *errors;
+
+    for (p = files; p; p = p->next)
+        ++n;
+    paths = (const char**)malloc(sizeof(char*) * (n ? n : 1));
+    errors = (int*)malloc(sizeof(int) * (n ? n : 1));
+    if (!paths || !errors) {
+        free(paths);
+        free(errors);
+        DIE("Out of memory.\n");
+    }
+    for (p = files, n = 0; p; p = p->next)
+        paths[n++] = p->value;
+    touch_all(paths, n, timestamp, errors);
+    free(paths);
+    return errors;
+}
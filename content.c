@@ -0,0 +1,178 @@
+/* Telling whether a target was rebuilt when its timestamp says it wasn't, as
+ * with recipes that use cp -p or install -p, or only write their output if
+ * it would change.
+ *
+ * With make, recipes are run through our shim as make's SHELL, which notes
+ * each target whose recipe runs in a marker file. Otherwise a target counts
+ * as rebuilt if it was replaced or its size changed, and only when neither
+ * did do we read it to see whether its contents changed.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "internal.h"
+
+/* Set up the marker file, if we can. It is unlinked straight away and
+ * reaches the shim as an inherited descriptor, so nothing is left behind
+ * however we exit.
+ */
+static void open_marker(scrutineer_t *s) {
+    char path[PATH_MAX], *shim;
+    const char *tmp = getenv("TMPDIR");
+    int fd;
+
+    s->marker_tried = 1;
+    if (strcmp(s->backend->name, "make"))
+        return;
+    shim = s->shim ? strdup(s->shim) : find_program("scrutineer");
+    if (!shim) {
+        warn("Failed to find scrutineer to use as make's SHELL, so recipes "
+            "that keep their target's timestamp are only noticed if they "
+            "change it.\n");
+        return;
+    }
+    if (snprintf(path, sizeof(path), "%s/scrutineer.XXXXXX",
+            tmp ? tmp : "/tmp") >= (int)sizeof(path) ||
+            (fd = mkstemp(path)) < 0)
+        DIE("Failed to create a marker file in %s.\n", tmp ? tmp : "/tmp");
+    (void)unlink(path);
+    if (fcntl(fd, F_SETFL, O_APPEND)) {
+        close(fd);
+        DIE("Failed to set up the marker file.\n");
+    }
+
+    s->marker_shell = (char*)malloc(strlen("SHELL=") + strlen(shim) + 1);
+    if (!s->marker_shell) {
+        close(fd);
+        DIE("Out of memory.\n");
+    }
+    sprintf(s->marker_shell, "SHELL=%s", shim);
+    free(shim);
+    s->marker = fd;
+}
+
+void close_marker(scrutineer_t *s) {
+    if (s->marker >= 0)
+        close(s->marker);
+    s->marker = -1;
+    free(s->marker_shell);
+    s->marker_shell = NULL;
+}
+
+/* The command to build with so that recipes that run are noted, or s->build
+ * if we can't. Anything else has to be given back to unmark_recipes after
+ * the build.
+ */
+char **mark_recipes(scrutineer_t *s) {
+    char fd[16], **argv;
+    unsigned int i;
+
+    if (!s->marker_tried)
+        open_marker(s);
+    if (s->marker < 0)
+        return s->build;
+
+    if (ftruncate(s->marker, 0))
+        DIE("Failed to empty the marker file.\n");
+    sprintf(fd, "%d", s->marker);
+    if (setenv("SCRUTINEER_MARKER", fd, 1))
+        DIE("Failed to set SCRUTINEER_MARKER.\n");
+
+    /* make expands .SHELLFLAGS for each recipe, which gets the shim the
+     * target's name.
+     */
+    argv = (char**)malloc(sizeof(char*) * (s->target_arg + 4));
+    if (!argv)
+        DIE("Out of memory.\n");
+    for (i = 0; i <= s->target_arg; ++i)
+        argv[i] = s->build[i];
+    argv[i++] = s->marker_shell;
+    argv[i++] = ".SHELLFLAGS=$@ -c";
+    argv[i] = NULL;
+    return argv;
+}
+
+void unmark_recipes(scrutineer_t *s, char **argv) {
+    if (argv == s->build)
+        return;
+    (void)unsetenv("SCRUTINEER_MARKER");
+    free(argv);
+}
+
+/* Returns 1 if the last build ran target's recipe, 0 if not or -1 if we
+ * can't tell.
+ */
+static int recipe_ran(const scrutineer_t *s, const char *target) {
+    struct stat st;
+    char *text, *line;
+    ssize_t r;
+    int ran = 0;
+
+    if (s->marker < 0)
+        return -1;
+    if (fstat(s->marker, &st))
+        DIE("Failed to read the marker file.\n");
+    text = (char*)malloc((size_t)st.st_size + 1);
+    if (!text)
+        DIE("Out of memory.\n");
+    r = pread(s->marker, text, (size_t)st.st_size, 0);
+    if (r < 0) {
+        free(text);
+        DIE("Failed to read the marker file.\n");
+    }
+    text[r] = '\0';
+
+    target = normalise(target);
+    for (line = strtok(text, "\n"); line && !ran; line = strtok(NULL, "\n"))
+        ran = !strcmp(normalise(line), target);
+    free(text);
+    return ran;
+}
+
+/* Note what target is like now, to compare with after later builds. */
+void note_target(scrutineer_t *s, const char *target) {
+    struct stat st;
+
+    if (stat(target, &st))
+        DIE("Failed to stat %s.\n", target);
+    s->noted_ino = st.st_ino;
+    s->noted_size = st.st_size;
+    /* Without a marker we will need to know what was in it. */
+    if (s->marker < 0 && hash_file(target, &s->noted_hash))
+        DIE("Failed to read %s.\n", target);
+}
+
+/* Returns 1 if the last build rebuilt target in a way its timestamp doesn't
+ * show, or 0 if not. Whatever else changed, this leaves the target noted.
+ */
+int changed_anyway(scrutineer_t *s, const char *target) {
+    struct stat st;
+    uint64_t hash;
+    int ran;
+
+    if (stat(target, &st))
+        DIE("Failed to stat %s.\n", target);
+    if (st.st_ino != s->noted_ino || st.st_size != s->noted_size) {
+        note_target(s, target);
+        return 1;
+    }
+    ran = recipe_ran(s, target);
+    if (ran >= 0)
+        return ran;
+
+    /* Nothing else to go on, so look inside. */
+    if (hash_file(target, &hash))
+        DIE("Failed to read %s.\n", target);
+    if (hash == s->noted_hash)
+        return 0;
+    s->noted_hash = hash;
+    return 1;
+}
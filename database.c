@@ -0,0 +1,459 @@
+/* Reading the rules make prints with -p, and working out from them what a
+ * target could possibly depend on.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+/* How many times we chain pattern rules when looking for what a target could
+ * be made from. Make itself gives up long before this for anything real.
+ */
+#define MAX_CHAIN 8
+
+/* Split a string into words in place. Returns the number of words. */
+static size_t words(char *s, char ***out) {
+    char **w = NULL, *tok;
+    size_t n = 0;
+
+    for (tok = strtok(s, " \t"); tok; tok = strtok(NULL, " \t")) {
+        w = (char**)realloc(w, sizeof(char*) * (n + 1));
+        if (!w)
+            DIE("Out of memory.\n");
+        w[n++] = tok;
+    }
+    *out = w;
+    return n;
+}
+
+static void add_pattern(pattern_t **patterns, size_t *count,
+        const char *target, char *const *prereqs, size_t n) {
+    pattern_t *p;
+    size_t i;
+
+    *patterns = (pattern_t*)realloc(*patterns,
+        sizeof(pattern_t) * (*count + 1));
+    if (!*patterns)
+        DIE("Out of memory.\n");
+    p = &(*patterns)[(*count)++];
+    p->target = strdup(target);
+    p->prereqs = (char**)malloc(sizeof(char*) * (n + 1));
+    if (!p->target || !p->prereqs)
+        DIE("Out of memory.\n");
+    for (i = 0; i < n; ++i)
+        p->prereqs[i] = strdup(prereqs[i]);
+    p->prereqs[n] = NULL;
+}
+
+/* Parse a rule line, "targets: prerequisites | order-only", from the files or
+ * implicit rules section, leaving its targets in current. Returns 0 if it was
+ * something else, like a target specific variable.
+ */
+static int parse_rule(database_t *db, char *line, int implicit,
+        strings_t *current) {
+    char *colon, **targets, **prereqs, *bar;
+    size_t ntargets, nprereqs, i;
+    int terminal = 0;
+
+    colon = strchr(line, ':');
+    if (!colon || colon == line)
+        return 0;
+    *colon++ = '\0';
+    if (*colon == ':') {
+        terminal = 1;
+        ++colon;
+    }
+    if (strchr(colon, '='))
+        return 0;
+
+    /* Order-only prerequisites never cause a rebuild. */
+    bar = strchr(colon, '|');
+    if (bar)
+        *bar = '\0';
+
+    ntargets = words(line, &targets);
+    nprereqs = words(colon, &prereqs);
+    for (i = 0; i < ntargets; ++i) {
+        append(current, strdup(targets[i]));
+        if (!implicit)
+            add_rule(&db->rules, targets[i], prereqs, nprereqs);
+        /* A match-anything or terminal rule would have us consider every
+         * file as being made from things like RCS/x,v, which tells us
+         * nothing.
+         */
+        else if (!terminal && nprereqs > 0 && strcmp(targets[i], "%"))
+            add_pattern(&db->patterns, &db->npatterns, targets[i], prereqs,
+                nprereqs);
+    }
+    free(targets);
+    free(prereqs);
+    return 1;
+}
+
+static void clear(strings_t *v) {
+    size_t i;
+
+    for (i = 0; i < v->count; ++i)
+        free((char*)v->items[i]);
+    v->count = 0;
+}
+
+/* Add each of a colon separated list of directories as a search path for
+ * pattern.
+ */
+static void add_vpath(database_t *db, const char *pattern, char *dirs) {
+    char *dir;
+
+    for (dir = strtok(dirs, ":"); dir; dir = strtok(NULL, ":"))
+        add_pattern(&db->vpath, &db->nvpath, pattern, &dir, 1);
+}
+
+/* Run make -p -n for targets and read its database. Returns 0 on success or
+ * -1 if make did not give us one.
+ */
+int read_database(char *const *tool, unsigned int tool_len,
+        const char *const *targets, size_t n, database_t *db) {
+    enum { NONE, VARIABLES, FILES, IMPLICIT, VPATH } section = NONE;
+    strings_t current = { NULL, 0 };
+    int recipe = 0; /* Whether current has a recipe. */
+    const char **args;
+    char **argv, *out, *line, *next;
+    int found = 0;
+    size_t i;
+
+    memset(db, 0, sizeof(*db));
+    args = (const char**)malloc(sizeof(char*) * (n + 2));
+    if (!args)
+        DIE("Out of memory.\n");
+    args[0] = "-p";
+    args[1] = "-n";
+    for (i = 0; i < n; ++i)
+        args[i + 2] = targets[i];
+    argv = command(tool, tool_len, args, (unsigned int)n + 2);
+    out = run_output(argv);
+    free(argv);
+    free(args);
+    if (!out)
+        return -1;
+
+    for (line = out; line; line = next) {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+
+        if (!strncmp(line, "# Make data base", 16)) {
+            found = 1;
+            continue;
+        }
+        if (!found)
+            continue; /* Output of the dry run itself. */
+
+        if (!strcmp(line, "# Variables"))
+            section = VARIABLES;
+        else if (!strcmp(line, "# Files"))
+            section = FILES;
+        else if (!strcmp(line, "# Implicit Rules"))
+            section = IMPLICIT;
+        else if (!strcmp(line, "# VPATH Search Paths"))
+            section = VPATH;
+        else if (line[0] == '\0') {
+            clear(&current);
+            recipe = 0;
+        }
+        else if (line[0] == '\t') {
+            /* A recipe. What a recursive make depends on is hidden from us.
+             */
+            if (!recipe)
+                for (i = 0; i < current.count; ++i)
+                    append(&db->recipes, strdup(normalise(current.items[i])));
+            recipe = 1;
+            if (strstr(line, "$(MAKE)") || strstr(line, "${MAKE}"))
+                for (i = 0; i < current.count; ++i) {
+                    const char *t = normalise(current.items[i]);
+                    if (!contains(&db->recursive, t))
+                        append(&db->recursive, strdup(t));
+                }
+        } else if (!strcmp(line, "#  File is an intermediate prerequisite.")) {
+            /* Make deletes these after a build and only remakes them when
+             * something else needs updating, which we don't model.
+             */
+            for (i = 0; i < current.count; ++i)
+                append(&db->intermediate, strdup(normalise(current.items[i])));
+        } else if (section == VARIABLES &&
+                !strncmp(line, "MAKEFILE_LIST := ", 17)) {
+            char **w;
+            size_t nw = words(line + 17, &w);
+
+            for (i = 0; i < nw; ++i)
+                append(&db->makefiles, strdup(normalise(w[i])));
+            free(w);
+        } else if (section == VPATH && !strncmp(line, "vpath ", 6)) {
+            /* "vpath %.c src:include" */
+            char **w;
+
+            if (words(line + 6, &w) == 2)
+                add_vpath(db, w[0], w[1]);
+            free(w);
+        } else if (section == VPATH &&
+                !strncmp(line, "# General ('VPATH' variable)", 28)) {
+            /* The next line is "# src:include". */
+            line = next;
+            if (line) {
+                next = strchr(line, '\n');
+                if (next)
+                    *next++ = '\0';
+                if (!strncmp(line, "# ", 2))
+                    add_vpath(db, "%", line + 2);
+            }
+        } else if (line[0] != '#' && (section == FILES ||
+                section == IMPLICIT)) {
+            clear(&current);
+            recipe = 0;
+            parse_rule(db, line, section == IMPLICIT, &current);
+        }
+    }
+    clear(&current);
+    free(current.items);
+    free(out);
+    return found ? 0 : -1;
+}
+
+static void free_patterns(pattern_t *patterns, size_t count) {
+    size_t i;
+    char **p;
+
+    for (i = 0; i < count; ++i) {
+        free(patterns[i].target);
+        for (p = patterns[i].prereqs; *p; ++p)
+            free(*p);
+        free(patterns[i].prereqs);
+    }
+    free(patterns);
+}
+
+void free_database(database_t *db) {
+    free_depfiles(&db->rules);
+    free_patterns(db->patterns, db->npatterns);
+    free_patterns(db->vpath, db->nvpath);
+    clear(&db->recursive);
+    free(db->recursive.items);
+    clear(&db->makefiles);
+    free(db->makefiles.items);
+    clear(&db->intermediate);
+    free(db->intermediate.items);
+    clear(&db->recipes);
+    free(db->recipes.items);
+    memset(db, 0, sizeof(*db));
+}
+
+/* Match name against a pattern like make does, returning the stem or NULL.
+ * A pattern without a slash matches the name's last component; the directory
+ * is returned in dir so it can be put back on the prerequisites. The caller
+ * owns the results.
+ */
+static char *match(const char *pattern, const char *name, char **dir) {
+    const char *percent = strchr(pattern, '%'), *base = name;
+    size_t prefix, suffix, len;
+
+    if (!percent)
+        return NULL;
+    if (!strchr(pattern, '/')) {
+        const char *slash = strrchr(name, '/');
+        if (slash)
+            base = slash + 1;
+    }
+    prefix = percent - pattern;
+    suffix = strlen(percent + 1);
+    len = strlen(base);
+    if (len <= prefix + suffix || strncmp(base, pattern, prefix) ||
+            strcmp(base + len - suffix, percent + 1))
+        return NULL;
+    *dir = strndup(name, base - name);
+    return strndup(base + prefix, len - prefix - suffix);
+}
+
+/* Substitute a stem into a prerequisite pattern. */
+static char *substitute(const char *prereq, const char *stem,
+        const char *dir) {
+    const char *percent = strchr(prereq, '%');
+    size_t len;
+    char *s;
+
+    if (!percent)
+        return strdup(prereq);
+    len = strlen(dir) + strlen(prereq) + strlen(stem);
+    s = (char*)malloc(len);
+    if (!s)
+        DIE("Out of memory.\n");
+    snprintf(s, len, "%s%.*s%s%s", strchr(prereq, '/') ? "" : dir,
+        (int)(percent - prereq), prereq, stem, percent + 1);
+    return s;
+}
+
+/* Add a rule for name from each pattern it matches. For search paths the
+ * "prerequisite" is where make may find name instead.
+ */
+static void instantiate(const pattern_t *patterns, size_t count,
+        const char *name, int search, depfiles_t *d) {
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        char *dir, *stem = match(patterns[i].target, name, &dir);
+        char **prereqs = NULL;
+        size_t n = 0;
+        char **p;
+
+        if (!stem)
+            continue;
+        for (p = patterns[i].prereqs; *p; ++p) {
+            prereqs = (char**)realloc(prereqs, sizeof(char*) * (n + 1));
+            if (!prereqs)
+                DIE("Out of memory.\n");
+            prereqs[n++] = search ? join(*p, name) :
+                substitute(*p, stem, dir);
+        }
+        add_rule(d, name, prereqs, n);
+        while (n > 0)
+            free(prereqs[--n]);
+        free(prereqs);
+        free(stem);
+        free(dir);
+    }
+}
+
+/* Add rules to d for everything target could possibly depend on: the rules
+ * make used, any pattern rules that could apply to the files involved and
+ * where make could find them on its search paths. The build files and
+ * whatever they are made from are included too, as regenerating them may
+ * change anything. Returns -1 if make would run a recursive make on the way,
+ * as we can't see what that depends on.
+ */
+int reachable_rules(database_t *db, const char *target, depfiles_t *d) {
+    strings_t expanded = { NULL, 0 };
+    const char **files;
+    size_t n, i, round;
+    int ret = 0;
+
+    for (i = 0; i < db->rules.count; ++i) {
+        char **p = db->rules.rules[i].prereqs;
+
+        for (n = 0; p[n]; ++n);
+        add_rule(d, db->rules.rules[i].target, p, n);
+    }
+    add_rule(d, target, (char**)db->makefiles.items, db->makefiles.count);
+
+    /* Keep applying pattern rules to the files we have reached until there
+     * is nothing new.
+     */
+    for (round = 0; round < MAX_CHAIN; ++round) {
+        size_t before = d->count;
+
+        files = prior(d, target, &n);
+        for (i = 0; i <= n; ++i) {
+            const char *f = i < n ? files[i] : normalise(target);
+
+            if (contains(&expanded, f))
+                continue;
+            append(&expanded, strdup(f));
+            instantiate(db->patterns, db->npatterns, f, 0, d);
+            instantiate(db->vpath, db->nvpath, f, 1, d);
+        }
+        free(files);
+        if (d->count == before)
+            break;
+    }
+
+    files = prior(d, target, &n);
+    if (contains(&db->recursive, normalise(target)))
+        ret = -1;
+    for (i = 0; !ret && i < n; ++i)
+        if (contains(&db->recursive, files[i]))
+            ret = -1;
+    free(files);
+    clear(&expanded);
+    free(expanded.items);
+    return ret;
+}
+
+/* Find a prerequisite on the search paths like make does. The caller owns the
+ * result.
+ */
+static char *locate(const database_t *db, const char *name) {
+    size_t i;
+
+    if (exists(name))
+        return strdup(name);
+    for (i = 0; i < db->nvpath; ++i) {
+        char *dir, *stem = match(db->vpath[i].target, name, &dir);
+
+        if (stem) {
+            char *path = join(db->vpath[i].prereqs[0], name);
+
+            free(stem);
+            free(dir);
+            if (exists(path))
+                return path;
+            free(path);
+        }
+    }
+    return strdup(name);
+}
+
+/* Add rules to d for exactly what make would consider when deciding whether
+ * target is up to date, with prerequisites found on the search paths. This
+ * answers whether touching a file rebuilds target without running make.
+ * Returns -1 if the answer involves something we don't model, like a
+ * recursive make or an intermediate file.
+ */
+int rule_graph(database_t *db, const char *target, depfiles_t *d) {
+    const char **files;
+    size_t n, i, j;
+    int ret = 0;
+
+    qsort(db->recipes.items, db->recipes.count, sizeof(char*),
+        compare_strings);
+    for (i = 0; i < db->rules.count; ++i) {
+        const rule_t *r = &db->rules.rules[i];
+        const char *t = r->target;
+        char **prereqs;
+
+        for (n = 0; r->prereqs[n]; ++n);
+
+        /* A file with no recipe is never changed by being updated, so what
+         * it depends on doesn't matter.
+         */
+        if (exists(t) && !bsearch(&t, db->recipes.items, db->recipes.count,
+                sizeof(char*), compare_strings))
+            n = 0;
+        prereqs = (char**)malloc(sizeof(char*) * (2 * n + 1));
+        if (!prereqs)
+            DIE("Out of memory.\n");
+        /* Keep the name as written as well, in case it has rules of its own.
+         */
+        for (j = 0; j < n; ++j) {
+            prereqs[2 * j] = r->prereqs[j];
+            prereqs[2 * j + 1] = locate(db, r->prereqs[j]);
+        }
+        add_rule(d, r->target, prereqs, 2 * n);
+        for (j = 0; j < n; ++j)
+            free(prereqs[2 * j + 1]);
+        free(prereqs);
+
+        if (!strcmp(r->target, ".INTERMEDIATE"))
+            for (j = 0; j < n; ++j)
+                append(&db->intermediate, strdup(normalise(r->prereqs[j])));
+    }
+
+    files = prior(d, target, &n);
+    for (i = 0; i <= n && !ret; ++i) {
+        const char *f = i < n ? files[i] : normalise(target);
+
+        if (contains(&db->recursive, f) || contains(&db->intermediate, f))
+            ret = -1;
+    }
+    free(files);
+    return ret;
+}
@@ -0,0 +1,248 @@
+/* Reading compiler-generated depfiles.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "internal.h"
+
+static int compare_rules(const void *a, const void *b) {
+    return strcmp(((const rule_t*)a)->target, ((const rule_t*)b)->target);
+}
+
+/* Read the next word from a depfile, handling escapes and line
+ * continuations. Returns NULL at the end of a line (setting *eol) or of the
+ * file. The caller owns the result.
+ */
+static char *next_word(const char **s, int *eol) {
+    const char *p = *s;
+    char *word;
+    size_t len = 0;
+
+    *eol = 0;
+    for (;;) {
+        if (p[0] == '\\' && p[1] == '\n')
+            p += 2;
+        else if (p[0] == '\\' && p[1] == '\r' && p[2] == '\n')
+            p += 3;
+        else if (*p == ' ' || *p == '\t' || *p == '\r')
+            ++p;
+        else
+            break;
+    }
+    if (*p == '\0' || *p == '\n') {
+        *eol = *p == '\n';
+        *s = *p ? p + 1 : p;
+        return NULL;
+    }
+
+    word = (char*)malloc(strlen(p) + 1);
+    if (!word)
+        DIE("Out of memory.\n");
+    while (*p != '\0' && *p != '\n' && *p != ' ' && *p != '\t' &&
+           *p != '\r') {
+        if (p[0] == '\\' && (p[1] == ' ' || p[1] == '#' || p[1] == '\\'))
+            ++p;
+        else if (p[0] == '\\' && p[1] == '\n')
+            break;
+        else if (p[0] == '$' && p[1] == '$')
+            ++p;
+        word[len++] = *p++;
+    }
+    word[len] = '\0';
+    *s = p;
+    return word;
+}
+
+/* Add a target's prerequisites to the known rules. */
+void add_rule(depfiles_t *d, const char *target, char **prereqs,
+        size_t n) {
+    rule_t *r;
+    size_t i;
+
+    d->rules = (rule_t*)realloc(d->rules, sizeof(rule_t) * (d->count + 1));
+    if (!d->rules)
+        DIE("Out of memory.\n");
+    r = &d->rules[d->count++];
+    r->target = strdup(normalise(target));
+    r->prereqs = (char**)malloc(sizeof(char*) * (n + 1));
+    if (!r->target || !r->prereqs)
+        DIE("Out of memory.\n");
+    for (i = 0; i < n; ++i)
+        r->prereqs[i] = strdup(normalise(prereqs[i]));
+    r->prereqs[n] = NULL;
+    r->visited = 0;
+}
+
+/* Parse a depfile as produced by gcc -MD and add its rules. */
+void read_depfile(const char *path, depfiles_t *d) {
+    char *text, *word;
+    const char *s;
+    FILE *f;
+    long size;
+    int eol;
+
+    f = fopen(path, "r");
+    if (!f) {
+        warn("failed to open depfile %s.\n", path);
+        return;
+    }
+    if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+            fseek(f, 0, SEEK_SET)) {
+        fclose(f);
+        return;
+    }
+    text = (char*)malloc(size + 1);
+    if (!text)
+        DIE("Out of memory.\n");
+    text[fread(text, 1, size, f)] = '\0';
+    fclose(f);
+
+    /* Each line is a list of targets, a colon and a list of prerequisites. */
+    s = text;
+    while (*s) {
+        char **targets = NULL, **prereqs = NULL;
+        size_t nt = 0, np = 0, i;
+        int colon = 0;
+
+        while ((word = next_word(&s, &eol))) {
+            size_t len = strlen(word);
+
+            if (word[0] == '#') {
+                /* Skip the rest of a comment line. */
+                free(word);
+                while (*s && *s != '\n')
+                    ++s;
+                continue;
+            }
+            if (!colon && len > 0 && word[len - 1] == ':') {
+                word[len - 1] = '\0';
+                colon = 1;
+                if (len == 1) {
+                    free(word);
+                    continue;
+                }
+                targets = (char**)realloc(targets, sizeof(char*) * (nt + 1));
+                targets[nt++] = word;
+                continue;
+            }
+            if (colon) {
+                prereqs = (char**)realloc(prereqs, sizeof(char*) * (np + 1));
+                prereqs[np++] = word;
+            } else {
+                targets = (char**)realloc(targets, sizeof(char*) * (nt + 1));
+                targets[nt++] = word;
+            }
+        }
+
+        if (colon)
+            for (i = 0; i < nt; ++i)
+                add_rule(d, targets[i], prereqs, np);
+        for (i = 0; i < nt; ++i)
+            free(targets[i]);
+        for (i = 0; i < np; ++i)
+            free(prereqs[i]);
+        free(targets);
+        free(prereqs);
+        if (!eol && !*s)
+            break;
+    }
+    free(text);
+}
+
+/* Read every depfile under dir that was written at or after since. */
+void find_depfiles(const char *dir, time_t since, depfiles_t *d) {
+    DIR *dp;
+    struct dirent *e;
+
+    dp = opendir(dir);
+    if (!dp)
+        return;
+    while ((e = readdir(dp))) {
+        struct stat st;
+        size_t len;
+        char *path;
+
+        if (is_dot(e->d_name) || !strcmp(e->d_name, ".git"))
+            continue;
+        path = strcmp(dir, ".") ? join(dir, e->d_name) : strdup(e->d_name);
+        len = strlen(path);
+        if (!lstat(path, &st)) {
+            if (S_ISDIR(st.st_mode))
+                find_depfiles(path, since, d);
+            else if (S_ISREG(st.st_mode) && st.st_mtime >= since &&
+                     len > 2 && !strcmp(path + len - 2, ".d"))
+                read_depfile(path, d);
+        }
+        free(path);
+    }
+    closedir(dp);
+}
+
+void free_depfiles(depfiles_t *d) {
+    size_t i;
+    char **p;
+
+    for (i = 0; i < d->count; ++i) {
+        free(d->rules[i].target);
+        for (p = d->rules[i].prereqs; *p; ++p)
+            free(*p);
+        free(d->rules[i].prereqs);
+    }
+    free(d->rules);
+    d->rules = NULL;
+    d->count = 0;
+}
+
+/* Collect everything target transitively depends on according to the
+ * depfiles.
+ */
+static void collect(depfiles_t *d, const char *target, const char ***found,
+        size_t *n) {
+    const rule_t key = { (char*)target, NULL, 0 };
+    rule_t *r;
+    char **p;
+
+    /* There may be several rules for the same target; visit them all. */
+    r = (rule_t*)bsearch(&key, d->rules, d->count, sizeof(rule_t),
+        compare_rules);
+    if (!r)
+        return;
+    while (r > d->rules && !strcmp((r - 1)->target, target))
+        --r;
+    for (; r < d->rules + d->count && !strcmp(r->target, target); ++r) {
+        if (r->visited)
+            continue;
+        r->visited = 1;
+        for (p = r->prereqs; *p; ++p) {
+            *found = (const char**)realloc(*found,
+                sizeof(char*) * (*n + 1));
+            if (!*found)
+                DIE("Out of memory.\n");
+            (*found)[(*n)++] = *p;
+            collect(d, *p, found, n);
+        }
+    }
+}
+
+/* Returns a sorted list of everything target depends on according to the
+ * depfiles, for use with bsearch. The strings belong to d.
+ */
+const char **prior(depfiles_t *d, const char *target, size_t *n) {
+    const char **found = NULL;
+    size_t i;
+
+    qsort(d->rules, d->count, sizeof(rule_t), compare_rules);
+    for (i = 0; i < d->count; ++i)
+        d->rules[i].visited = 0;
+    *n = 0;
+    collect(d, normalise(target), &found, n);
+    qsort(found, *n, sizeof(char*), compare_strings);
+    return found;
+}
+
@@ -0,0 +1,128 @@
+/* Keeping the directories of the files we look at and touch open, so each
+ * look or touch only has the kernel resolve the last part of the path.
+ *
+ * We keep directories rather than the files themselves because builds
+ * replace their outputs with new files. A directory can be replaced too, by
+ * a recipe like rm -rf out && mkdir out, which we notice when a file in it
+ * seems to be missing and the directory we kept has no links left.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "internal.h"
+
+/* The most directories to keep open, whatever the descriptor limit. */
+#define MAX_DIRS 1024
+
+static size_t slot_of(const dir_fds_t *d, const char *dir, size_t len) {
+    size_t i = (size_t)hash_bytes(HASH_SEED, dir, len) & (d->size - 1);
+
+    /* There is always an empty slot, so this stops. */
+    while (d->slots[i].dir && (strlen(d->slots[i].dir) != len ||
+            strncmp(d->slots[i].dir, dir, len)))
+        i = (i + 1) & (d->size - 1);
+    return i;
+}
+
+/* Set up the table, keeping well within the limit on open descriptors as
+ * builds need some too.
+ */
+static void open_table(dir_fds_t *d) {
+    struct rlimit rl;
+    size_t cap = MAX_DIRS;
+
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY &&
+            rl.rlim_cur / 4 < cap)
+        cap = (size_t)(rl.rlim_cur / 4);
+    d->cap = cap;
+    for (d->size = 16; d->size < 2 * cap; d->size *= 2);
+    d->slots = (dir_fd_t*)calloc(d->size, sizeof(dir_fd_t));
+    if (!d->slots)
+        DIE("Out of memory.\n");
+}
+
+/* Open the slot's directory, leaving its descriptor -1 if it isn't there
+ * (yet).
+ */
+static void open_dir(dir_fd_t *slot) {
+    slot->fd = open(slot->dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+/* Find path as an open directory and a name in it. Paths in directories we
+ * can't keep open, or outside a library call, are left relative to the
+ * working directory.
+ */
+at_t path_at(const char *path) {
+    scrutineer_t *s = scrutineer_current;
+    at_t at = { AT_FDCWD, path };
+    size_t len = dir_len(path), i;
+    dir_fd_t *slot;
+
+    if (!s || len == 0 || path[len] == '\0')
+        return at;
+    if (!s->dir_fds.slots)
+        open_table(&s->dir_fds);
+    i = slot_of(&s->dir_fds, path, len);
+    slot = &s->dir_fds.slots[i];
+    if (!slot->dir) {
+        if (s->dir_fds.count >= s->dir_fds.cap)
+            return at;
+        slot->dir = strndup(path, len);
+        if (!slot->dir)
+            DIE("Out of memory.\n");
+        ++s->dir_fds.count;
+        open_dir(slot);
+    } else if (slot->fd < 0)
+        /* The build may have made it since. */
+        open_dir(slot);
+    if (slot->fd < 0)
+        return at;
+    at.fd = slot->fd;
+    at.leaf = path + len;
+    return at;
+}
+
+/* After an operation on at found nothing there, check whether that's
+ * because its directory was replaced. If so, update at to the new one and
+ * return 1 to say the operation is worth trying again.
+ */
+int path_moved(const char *path, at_t *at) {
+    scrutineer_t *s = scrutineer_current;
+    dir_fd_t *slot;
+    struct stat st;
+
+    if (at->fd == AT_FDCWD || !s || !s->dir_fds.slots ||
+            fstat(at->fd, &st) || st.st_nlink > 0)
+        return 0;
+    slot = &s->dir_fds.slots[slot_of(&s->dir_fds, path, dir_len(path))];
+    close(slot->fd);
+    open_dir(slot);
+    if (slot->fd < 0) {
+        /* Not replaced, just removed, which the full path will confirm. */
+        at->fd = AT_FDCWD;
+        at->leaf = path;
+    } else
+        at->fd = slot->fd;
+    return 1;
+}
+
+void close_dirs(dir_fds_t *d) {
+    size_t i;
+
+    for (i = 0; i < d->size; ++i)
+        if (d->slots[i].dir) {
+            if (d->slots[i].fd >= 0)
+                close(d->slots[i].fd);
+            free(d->slots[i].dir);
+        }
+    free(d->slots);
+    memset(d, 0, sizeof(*d));
+}
@@ -0,0 +1,208 @@
+/* Estimating how many missing edges a target has from a sample of the
+ * candidates, when probing all of them would take too long. A missing edge is
+ * a file the target uses, according to the compiler's depfiles or the build
+ * system, that touching does not rebuild it.
+ *
+ * The candidates are split by directory and each directory gets a share of
+ * the sample in proportion to its size, so a few large directories can't
+ * crowd the rest out. The sample is group tested, and the files it uses that
+ * were not found to be dependencies are missing edges. The proportion of
+ * them is scaled back up with a Wilson score interval around it.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+/* For a 95% confidence interval. */
+#define Z 1.959964
+
+/* The candidates in one directory. */
+typedef struct {
+    const char **files;
+    size_t count; /* In the directory. */
+    size_t sampled; /* How many of them to probe. */
+    size_t missing; /* Missing edges among those probed. */
+    int topped_up; /* Whether it got one of the samples rounding left over. */
+} stratum_t;
+
+/* The stratum for path's directory, adding one if there isn't one yet. */
+static stratum_t *stratum(stratum_t **strata, size_t *n, const char *path) {
+    size_t len = dir_len(path), i;
+    stratum_t *st;
+
+    for (i = 0; i < *n; ++i) {
+        const char *first = (*strata)[i].files[0];
+
+        if (dir_len(first) == len && !strncmp(first, path, len))
+            return &(*strata)[i];
+    }
+    *strata = (stratum_t*)realloc(*strata, sizeof(stratum_t) * (*n + 1));
+    if (!*strata)
+        DIE("Out of memory.\n");
+    st = &(*strata)[(*n)++];
+    memset(st, 0, sizeof(*st));
+    return st;
+}
+
+/* Share out a sample of size among the strata in proportion to their sizes,
+ * giving what rounding leaves over to those it shortchanged most, one each.
+ */
+static void allocate(stratum_t *strata, size_t n, size_t total, size_t size) {
+    size_t given = 0, i;
+
+    for (i = 0; i < n; ++i) {
+        strata[i].sampled = size * strata[i].count / total;
+        given += strata[i].sampled;
+    }
+    while (given < size) {
+        size_t best = n;
+
+        for (i = 0; i < n; ++i)
+            if (!strata[i].topped_up &&
+                    strata[i].sampled < strata[i].count && (best == n ||
+                    size * strata[i].count % total >
+                    size * strata[best].count % total))
+                best = i;
+        if (best == n) {
+            /* Everyone has had one. Only strata too small to take their
+             * share can leave us here, so go round again.
+             */
+            for (i = 0; i < n; ++i)
+                strata[i].topped_up = 0;
+            continue;
+        }
+        strata[best].topped_up = 1;
+        ++strata[best].sampled;
+        ++given;
+    }
+}
+
+/* Wilson score interval for a proportion p seen in n of a population of
+ * total, with a finite population correction.
+ */
+static void wilson(double p, size_t n, size_t total, double *low,
+        double *high) {
+    double z2 = Z * Z, centre, half;
+
+    if (total > 1)
+        z2 *= (double)(total - n) / (double)(total - 1);
+    centre = (p + z2 / (2 * n)) / (1 + z2 / n);
+    half = sqrt(z2) / (1 + z2 / n) *
+        sqrt(p * (1 - p) / n + z2 / (4.0 * n * n));
+    *low = centre - half < 0 ? 0 : centre - half;
+    *high = centre + half > 1 ? 1 : centre + half;
+}
+
+/* Probe a sample of s->estimate of candidates and estimate how many of them
+ * are missing edges of p. before is from before p's initial build, for
+ * finding the depfiles it wrote. The dependencies found in the sample are
+ * noted as usual.
+ */
+void estimate(scrutineer_t *s, list_t *p, list_t *candidates, time_t before,
+        time_t *old) {
+    stratum_t *strata = NULL;
+    size_t nstrata = 0, total = 0, n = 0, found = 0, nused = 0, i, j;
+    const char **sample, **used = NULL;
+    depfiles_t d = { NULL, 0 };
+    int known, len;
+    double weight = 0;
+    scrutineer_estimate_t *e = &p->estimate;
+    char detail[256];
+    list_t *p1;
+
+    for (p1 = candidates; p1; p1 = p1->next) {
+        stratum_t *st = stratum(&strata, &nstrata, normalise(p1->value));
+
+        st->files = (const char**)realloc(st->files,
+            sizeof(char*) * (st->count + 1));
+        if (!st->files)
+            DIE("Out of memory.\n");
+        st->files[st->count++] = p1->value;
+        ++total;
+    }
+    if (total == 0)
+        return;
+    allocate(strata, nstrata, total,
+        s->estimate < total ? s->estimate : total);
+
+    /* Pick each stratum's share at random, moving it to the front. */
+    sample = (const char**)malloc(sizeof(char*) * total);
+    if (!sample)
+        DIE("Out of memory.\n");
+    for (i = 0; i < nstrata; ++i) {
+        stratum_t *st = &strata[i];
+
+        for (j = 0; j < st->sampled; ++j) {
+            size_t k = j + (size_t)rand_r(&s->seed) % (st->count - j);
+            const char *f = st->files[k];
+
+            st->files[k] = st->files[j];
+            st->files[j] = f;
+            sample[n++] = f;
+        }
+    }
+
+    group_test(s, p, sample, n, old, 0);
+
+    /* Compare with what the target uses, if anything can tell us. */
+    known = (s->strategy & SCRUTINEER_DEPFILES) || s->backend->known;
+    if (s->strategy & SCRUTINEER_DEPFILES)
+        find_depfiles(".", before, &d);
+    if (s->backend->known)
+        s->backend->known(s->build, s->target_arg, p->value, &d);
+    used = prior(&d, p->value, &nused);
+    for (i = 0; i < nstrata; ++i)
+        for (j = 0; j < strata[i].sampled; ++j) {
+            const char *f = strata[i].files[j];
+            int dep = contains(&p->found, f);
+
+            found += dep;
+            f = normalise(f);
+            if (known ? !dep && bsearch(&f, used, nused, sizeof(char*),
+                    compare_strings) : dep)
+                ++strata[i].missing;
+        }
+    free(used);
+    free_depfiles(&d);
+
+    /* Weight each directory's rate by its size. Directories too small to
+     * get a share of the sample are taken to be like the rest.
+     */
+    e->candidates = total;
+    e->sampled = n;
+    e->found = found;
+    e->missing = 0;
+    e->rate = 0;
+    for (i = 0; i < nstrata; ++i) {
+        e->missing += strata[i].missing;
+        if (strata[i].sampled > 0) {
+            e->rate += (double)strata[i].count * strata[i].missing /
+                strata[i].sampled;
+            weight += strata[i].count;
+        }
+    }
+    e->rate /= weight;
+    wilson(e->rate, n, total, &e->low, &e->high);
+    e->known = known;
+    p->estimated = 1;
+
+    len = snprintf(detail, sizeof(detail), "sampled %zu of %zu candidates "
+        "and found %zu dependenc%s", n, total, found, found == 1 ? "y" : "ies");
+    if (known)
+        len += snprintf(detail + len, sizeof(detail) - len,
+            " and %zu missing edge%s", e->missing, e->missing == 1 ? "" : "s");
+    snprintf(detail + len, sizeof(detail) - len, "; an estimated %.1f%% "
+        "(95%% CI %.1f%%-%.1f%%) of candidates are %s", 100 * e->rate,
+        100 * e->low, 100 * e->high, known ? "missing edges" : "dependencies");
+    progress(s, SCRUTINEER_ESTIMATE, p->value, detail);
+
+    for (i = 0; i < nstrata; ++i)
+        free(strata[i].files);
+    free(strata);
+    free(sample);
+}
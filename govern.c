@@ -0,0 +1,168 @@
+/* Deciding how many targets the parallel check should build at once on a
+ * machine it shares with others.
+ *
+ * Every tick we look at how many tasks are runnable and, where the kernel
+ * keeps pressure stall information, what share of the time since the last
+ * tick something waited on CPU, memory or IO. Too much of either and we
+ * take a worker away, or half of them if it was memory, as swapping would
+ * slow everyone down far more than building less at once. When there is
+ * room for another worker's builds, and has been for a while, we add one.
+ * The kernel's one minute load average is too slow to steer by, but it has
+ * to have room too before we add one, so we don't climb back up into load
+ * that has only just eased.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+
+/* The share of the time something may stall, in percent, by default. */
+#define DEFAULT_STALL 10
+
+/* Ticks to wait after a change before making another, for its effect to
+ * show up in what we read.
+ */
+#define SETTLE 3
+
+/* How much of each new reading of the runnable tasks to take. */
+#define SMOOTHING 0.5
+
+static const char *const resources[] = { "cpu", "memory", "io" };
+
+/* The microseconds something has stalled on resource since boot, or -1 if
+ * the kernel doesn't say.
+ */
+static long long stalled(const char *resource) {
+    char path[64], line[256];
+    long long total = -1;
+    FILE *f;
+
+    sprintf(path, "/proc/pressure/%s", resource);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "some avg10=%*f avg60=%*f avg300=%*f total=%lld",
+                &total) == 1)
+            break;
+    fclose(f);
+    return total;
+}
+
+/* Read the load average and the tasks runnable right now, besides us. */
+static int load(double *average, unsigned int *runnable) {
+    unsigned int running = 0;
+    FILE *f = fopen("/proc/loadavg", "r");
+    int ok;
+
+    if (!f)
+        return -1;
+    ok = fscanf(f, "%lf %*f %*f %u/", average, &running) == 2;
+    fclose(f);
+    if (!ok)
+        return -1;
+    *runnable = running > 0 ? running - 1 : 0;
+    return 0;
+}
+
+/* Take a reading, noting in g->stall the most any resource stalled since
+ * the last, as a percentage.
+ */
+static void sample(governor_t *g) {
+    struct timespec now;
+    double elapsed;
+    unsigned int i, runnable;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (double)(now.tv_sec - g->then.tv_sec) * 1e6 +
+        (double)(now.tv_nsec - g->then.tv_nsec) / 1e3;
+    g->then = now;
+    g->memory = 0;
+    g->stall = 0;
+    for (i = 0; i < sizeof(resources) / sizeof(resources[0]); ++i) {
+        long long total = stalled(resources[i]);
+        double share;
+
+        if (total < 0 || g->totals[i] < 0 || elapsed <= 0) {
+            g->totals[i] = total;
+            continue;
+        }
+        share = 100.0 * (double)(total - g->totals[i]) / elapsed;
+        g->totals[i] = total;
+        if (share > g->stall)
+            g->stall = share;
+        if (i == 1)
+            g->memory = share;
+    }
+
+    if (load(&g->average, &runnable))
+        g->average = g->runnable = 0;
+    else if (g->runnable < 0)
+        g->runnable = runnable;
+    else
+        g->runnable += SMOOTHING * ((double)runnable - g->runnable);
+}
+
+/* Set g up to share out up to ceiling workers, each of whose builds may run
+ * weight tasks at once, and return how many to start with.
+ */
+unsigned int start_governor(governor_t *g, const scrutineer_t *s,
+        unsigned int ceiling, unsigned int weight) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int i;
+    double room;
+
+    memset(g, 0, sizeof(*g));
+    g->ceiling = ceiling ? ceiling : 1;
+    g->weight = weight ? weight : 1;
+    g->max_load = s->max_load ? s->max_load : cpus > 0 ? (double)cpus : 1;
+    g->max_stall = s->max_stall ? s->max_stall : DEFAULT_STALL;
+    g->runnable = -1;
+    for (i = 0; i < sizeof(resources) / sizeof(resources[0]); ++i)
+        g->totals[i] = -1;
+    (void)clock_gettime(CLOCK_MONOTONIC, &g->then);
+    sample(g);
+
+    /* As many as there is room for now. */
+    room = (g->max_load - g->runnable) / g->weight;
+    g->limit = room < 1 ? 1 : room > g->ceiling ? g->ceiling :
+        (unsigned int)room;
+    return g->limit;
+}
+
+/* Return how many workers to have, taking another reading if a tick has
+ * passed since the last. A change only takes effect as builds finish, so
+ * unless memory is short we give each a few ticks before judging it.
+ */
+unsigned int govern(governor_t *g) {
+    struct timespec now;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - g->then.tv_sec < TICK ||
+            (now.tv_sec - g->then.tv_sec == TICK &&
+             now.tv_nsec < g->then.tv_nsec))
+        return g->limit;
+    sample(g);
+    ++g->since;
+
+    if (g->memory > g->max_stall) {
+        g->limit = g->limit > 1 ? g->limit / 2 : 1;
+        g->since = 0;
+    } else if (g->since >= SETTLE) {
+        if (g->stall > g->max_stall || g->runnable > g->max_load) {
+            if (g->limit > 1)
+                --g->limit;
+            g->since = 0;
+        } else if (g->limit < g->ceiling && g->stall < g->max_stall / 2 &&
+                g->runnable + g->weight <= g->max_load &&
+                g->average + g->weight <= g->max_load) {
+            ++g->limit;
+            g->since = 0;
+        }
+    }
+    return g->limit;
+}
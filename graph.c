@@ -0,0 +1,332 @@
+/* Saving the dependencies we found, and using them to limit a later run to
+ * what a change could have affected.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+/* The first line of a saved graph. */
+#define GRAPH_HEADER "# scrutineer graph 1"
+
+/* Write a path as make would read it as one word, with spaces and the
+ * characters make gives meaning to escaped as in a depfile.
+ */
+static void put_path(FILE *f, const char *path) {
+    for (; *path; ++path)
+        if (*path == ' ' || *path == '#')
+            fprintf(f, "\\%c", *path);
+        else if (*path == '$')
+            fputs("$$", f);
+        else if (*path == '\\' && (path[1] == ' ' || path[1] == '#' ||
+                path[1] == '\\' || path[1] == '\0'))
+            /* So this one isn't taken for an escape. */
+            fputs("\\\\", f);
+        else
+            fputc(*path, f);
+}
+
+/* Take the next word written by put_path from *s, undoing its escapes in
+ * place. Returns NULL if there are no more.
+ */
+static char *next_word(char **s) {
+    char *in = *s, *out, *word;
+
+    while (*in == ' ')
+        ++in;
+    if (*in == '\0')
+        return NULL;
+    word = out = in;
+    while (*in != '\0' && *in != ' ') {
+        if ((*in == '\\' && (in[1] == ' ' || in[1] == '#' ||
+                in[1] == '\\')) || (*in == '$' && in[1] == '$'))
+            ++in;
+        *out++ = *in++;
+    }
+    if (*in == ' ')
+        ++in;
+    *out = '\0';
+    *s = in;
+    return word;
+}
+
+/* Save what we found in a form we can read back with load_graph. It is also
+ * a valid Makefile fragment.
+ */
+void save_graph(const char *path, const list_t *targets,
+        const list_t *dependencies) {
+    const list_t *p;
+    FILE *f;
+    size_t i;
+
+    f = fopen(path, "w");
+    if (!f)
+        DIE("Failed to open %s for writing.\n", path);
+    fprintf(f, "%s\n# candidates:", GRAPH_HEADER);
+    for (p = dependencies; p; p = p->next) {
+        fputc(' ', f);
+        put_path(f, p->value);
+    }
+    fprintf(f, "\n");
+    for (p = targets; p; p = p->next) {
+        if (p->fingerprint)
+            fprintf(f, "# fingerprint %s %016llx\n", p->value,
+                (unsigned long long)p->fingerprint);
+        if (p->phony)
+            fprintf(f, "# phony: %s\n", p->value);
+        else if (p->dirty)
+            fprintf(f, "# dirty: %s\n", p->value);
+        else if (p->failed)
+            fprintf(f, "# failed: %s\n", p->value);
+        else {
+            put_path(f, p->value);
+            fputc(':', f);
+            for (i = 0; i < p->found.count; ++i) {
+                fputc(' ', f);
+                put_path(f, p->found.items[i]);
+            }
+            fprintf(f, "\n");
+        }
+    }
+    if (fclose(f))
+        DIE("Failed to write %s.\n", path);
+}
+
+/* Find a target by name. */
+list_t *find_target(list_t *targets, const char *name) {
+    for (; targets; targets = targets->next)
+        if (!strcmp(targets->value, name))
+            return targets;
+    return NULL;
+}
+
+/* Find a target by name, adding it if it is not there yet. */
+static list_t *get_target(list_t **targets, const char *name) {
+    list_t *p = find_target(*targets, name);
+
+    if (!p) {
+        p = (list_t*)calloc(1, sizeof(list_t));
+        if (!p)
+            DIE("Out of memory.\n");
+        p->value = strdup(name);
+        p->next = *targets;
+        *targets = p;
+    }
+    return p;
+}
+
+/* Read a graph written by save_graph. The candidates it was made with are
+ * added to candidates.
+ */
+static list_t *load_graph(const char *path, strings_t *candidates) {
+    list_t *targets = NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        DIE("Failed to open %s.\n", path);
+    if (getline(&line, &cap, f) < 0 ||
+            strncmp(line, GRAPH_HEADER, strlen(GRAPH_HEADER))) {
+        free(line);
+        fclose(f);
+        DIE("%s is not a graph saved by scrutineer.\n", path);
+    }
+
+    while ((len = getline(&line, &cap, f)) >= 0) {
+        char *s, *word, *colon;
+
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+
+        if (!strncmp(line, "# candidates:", 13)) {
+            s = line + 13;
+            while ((word = next_word(&s)))
+                append(candidates, strdup(word));
+        } else if (!strncmp(line, "# fingerprint ", 14)) {
+            char *hash;
+
+            s = line + 14;
+            hash = strrchr(s, ' ');
+            if (!hash)
+                DIE("Malformed fingerprint in %s.\n", path);
+            *hash++ = '\0';
+            get_target(&targets, s)->fingerprint =
+                (uint64_t)strtoull(hash, NULL, 16);
+        } else if (!strncmp(line, "# phony: ", 9)) {
+            get_target(&targets, line + 9)->phony = 1;
+        } else if (!strncmp(line, "# dirty: ", 9)) {
+            get_target(&targets, line + 9)->dirty = 1;
+        } else if (!strncmp(line, "# failed: ", 10)) {
+            get_target(&targets, line + 10)->failed = 1;
+        } else if (line[0] != '#' && (colon = strchr(line, ':'))) {
+            list_t *p;
+
+            *colon = '\0';
+            s = line;
+            if (!(word = next_word(&s)))
+                DIE("Malformed rule in %s.\n", path);
+            p = get_target(&targets, word);
+            s = colon + 1;
+            while ((word = next_word(&s)))
+                append(&p->found, strdup(word));
+        }
+    }
+    free(line);
+    fclose(f);
+    return targets;
+}
+
+/* Free the strings in v and v itself. */
+static void free_strings(strings_t *v) {
+    size_t i;
+
+    for (i = 0; i < v->count; ++i)
+        free((char*)v->items[i]);
+    free(v->items);
+    v->items = NULL;
+    v->count = 0;
+}
+
+/* Free a graph read by load_graph. */
+static void free_graph(list_t *targets) {
+    while (targets) {
+        list_t *next = targets->next;
+        free((char*)targets->value);
+        free_strings(&targets->found);
+        free(targets);
+        targets = next;
+    }
+}
+
+/* Ask git which files under the working directory changed in a revision
+ * range.
+ */
+static strings_t changed_files(const char *range) {
+    char *argv[] = { "git", "diff", "--name-only", "--relative", NULL, NULL };
+    strings_t changed = { NULL, 0 };
+    char *out, *line;
+
+    argv[4] = (char*)range;
+    out = run_output(argv);
+    if (!out)
+        DIE("Failed to list the files changed in %s.\n", range);
+    for (line = strtok(out, "\n"); line; line = strtok(NULL, "\n"))
+        append(&changed, strdup(line));
+    free(out);
+    return changed;
+}
+
+/* Returns 1 if a path looks like part of the build description. */
+static int is_build_file(const char *path, const strings_t *makefiles) {
+    static const char *const names[] = {
+        "Makefile", "makefile", "GNUmakefile", "build.ninja",
+    };
+    const char *name = strrchr(path, '/');
+    size_t i, len;
+
+    name = name ? name + 1 : path;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+        if (!strcmp(name, names[i]))
+            return 1;
+    len = strlen(name);
+    if ((len > 3 && !strcmp(name + len - 3, ".mk")) ||
+            (len > 6 && !strcmp(name + len - 6, ".ninja")))
+        return 1;
+    for (i = 0; i < makefiles->count; ++i)
+        if (!strcmp(normalise(path), normalise(makefiles->items[i])))
+            return 1;
+    return 0;
+}
+
+/* Assess only what a change could have affected, taking everything else from
+ * a previous graph. A target is probed again if it is new, if any of its
+ * dependencies changed or if its rules changed. Components that were not
+ * candidates last time are probed against every target.
+ */
+void assess_changes(scrutineer_t *s, const char *range, const char *graph) {
+    strings_t changed, before = { NULL, 0 };
+    list_t *previous, *p, *p1, *fresh = NULL;
+    int rules_changed = 0;
+    size_t i;
+
+    changed = changed_files(range);
+    previous = load_graph(graph, &before);
+
+    for (i = 0; i < changed.count; ++i)
+        if (is_build_file(changed.items[i], &s->makefiles))
+            rules_changed = 1;
+
+    /* Components that are new since last time. */
+    for (p1 = s->dependencies; p1; p1 = p1->next)
+        if (!contains(&before, p1->value)) {
+            list_t *temp = (list_t*)calloc(1, sizeof(list_t));
+            if (!temp)
+                DIE("Out of memory.\n");
+            temp->value = p1->value;
+            temp->next = fresh;
+            fresh = temp;
+        }
+
+    for (p = s->targets; p; p = p->next) {
+        const list_t *prev = find_target(previous, p->value);
+        int affected = !prev;
+
+        if (prev && rules_changed) {
+            p->fingerprint = s->backend->fingerprint ?
+                s->backend->fingerprint(s->build, s->target_arg, p->value) :
+                0;
+            affected = !p->fingerprint || p->fingerprint != prev->fingerprint;
+        } else if (prev)
+            p->fingerprint = prev->fingerprint;
+        for (i = 0; !affected && i < prev->found.count; ++i)
+            affected = contains(&changed, normalise(prev->found.items[i]));
+
+        progress(s, SCRUTINEER_TARGET_START, p->value, NULL);
+        if (affected) {
+            examine(s, p, s->dependencies);
+        } else {
+            /* Keep what we knew, less anything no longer a candidate. */
+            p->assessed = 1;
+            p->phony = prev->phony;
+            p->dirty = prev->dirty;
+            p->failed = prev->failed;
+            for (i = 0; i < prev->found.count; ++i)
+                for (p1 = s->dependencies; p1; p1 = p1->next)
+                    if (!strcmp(p1->value, prev->found.items[i])) {
+                        append(&p->found, p1->value);
+                        if (s->on_edge)
+                            s->on_edge(s->edge_data, p->value, p1->value, 1);
+                        break;
+                    }
+
+            if (fresh && !p->phony && !p->dirty && !p->failed) {
+                strings_t kept = p->found;
+
+                p->found.items = NULL;
+                p->found.count = 0;
+                examine(s, p, fresh);
+                for (i = 0; i < p->found.count; ++i)
+                    append(&kept, p->found.items[i]);
+                free(p->found.items);
+                p->found = kept;
+            }
+        }
+        progress(s, SCRUTINEER_TARGET_DONE, p->value, NULL);
+    }
+
+    while (fresh) {
+        p = fresh->next;
+        free(fresh);
+        fresh = p;
+    }
+    free_graph(previous);
+    free_strings(&before);
+    free_strings(&changed);
+}
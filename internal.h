@@ -0,0 +1,613 @@
+/* Definitions shared between the parts of libscrutineer. None of this is
+ * visible to users of the library.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#ifndef SCRUTINEER_INTERNAL_H
+#define SCRUTINEER_INTERNAL_H
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "scrutineer.h"
+
+/* Helper macro for bailing in the case of an unrecoverable error. Within a
+ * library call this makes the call fail with the given message; anywhere
+ * else it exits.
+ */
+#define DIE(...) die(__VA_ARGS__)
+
+#define DEFAULT_CLEAN "make clean"
+#define DEFAULT_BUILD "make"
+
+/* A growable array of strings. The strings are not owned by the array. */
+typedef struct {
+    const char **items;
+    size_t count;
+} strings_t;
+
+typedef struct list {
+    const char *value;
+    struct list *next;
+    int phony; /* Whether this target is .PHONY or not. */
+    int dirty; /* Whether this target is rebuilt even when nothing changed. */
+    int failed; /* Whether this target failed to build or timed out. */
+    int assessed; /* Whether we've tried to assess this target. */
+    strings_t found; /* The dependencies we found for this target. */
+    uint64_t fingerprint; /* A hash of this target's rules, or 0. */
+    unsigned int churn; /* Recent commits that changed this candidate. */
+    int affected; /* Whether touching the candidates rebuilt this target. */
+    int estimated; /* Whether estimate is filled in. */
+    scrutineer_estimate_t estimate;
+} list_t;
+
+/* A rule read from a compiler-generated depfile. */
+typedef struct {
+    char *target;
+    char **prereqs; /* NULL terminated. */
+    int visited;
+} rule_t;
+
+/* All the depfile rules we know about, sorted by target. */
+typedef struct {
+    rule_t *rules;
+    size_t count;
+} depfiles_t;
+
+/* A pattern rule, or a search path when the prerequisites are directories. */
+typedef struct {
+    char *target; /* Containing a %. */
+    char **prereqs; /* NULL terminated. */
+} pattern_t;
+
+/* What we read from make's database. */
+typedef struct {
+    depfiles_t rules; /* Explicit rules, and those implicit ones make used. */
+    pattern_t *patterns;
+    size_t npatterns;
+    pattern_t *vpath; /* Where to look for files matching each pattern. */
+    size_t nvpath;
+    strings_t recursive; /* Targets whose recipes run $(MAKE). Owned. */
+    strings_t makefiles; /* The build files make read. Owned. */
+    strings_t intermediate; /* Files make would delete. Owned. */
+    strings_t recipes; /* Targets with a recipe. Owned. */
+} database_t;
+
+/* The interface to a build system. Everything other than running builds and
+ * cleans is optional.
+ */
+typedef struct {
+    const char *name;
+    const char *default_build;
+    const char *default_clean;
+
+    /* Ask the build system whether target is out of date without building
+     * it. tool is the build command without a target. Returns 0 if it is
+     * definitely up to date, or 1 if it may not be and a real build is needed
+     * to find out.
+     */
+    int (*query)(char *const *tool, unsigned int tool_len, const char *target);
+
+    /* Add the dependencies the build system already knows about for target
+     * to d.
+     */
+    void (*known)(char *const *tool, unsigned int tool_len, const char *target,
+        depfiles_t *d);
+
+    /* Add rules to d for everything that could possibly cause target to be
+     * rebuilt, so that anything else need not be probed. It is fine for this
+     * to overestimate. Returns -1 if the build system can't tell us.
+     */
+    int (*reachable)(char *const *tool, unsigned int tool_len,
+        const char *target, depfiles_t *d);
+
+    /* Add rules to d for exactly what the build system considers when
+     * deciding whether target is out of date, so we can tell whether
+     * touching a file would rebuild it without building. Returns -1 if the
+     * build system can't tell us.
+     */
+    int (*graph)(char *const *tool, unsigned int tool_len,
+        const char *target, depfiles_t *d);
+
+    /* Hash the rules used to build target, so we can tell when editing the
+     * build files changed them. Returns 0 if this is not possible.
+     */
+    uint64_t (*fingerprint)(char *const *tool, unsigned int tool_len,
+        const char *target);
+
+    /* The commands that would build target from scratch, without running
+     * them, or NULL if the build system can't tell us. The caller owns the
+     * result.
+     */
+    char *(*recipe)(char *const *tool, unsigned int tool_len,
+        const char *target);
+
+    /* Add every file the build system knows how to make to targets, which
+     * owns them. Returns -1 if the build system can't tell us.
+     */
+    int (*targets)(char *const *tool, unsigned int tool_len,
+        strings_t *targets);
+} backend_t;
+
+/* A regular file found while walking a tree. */
+typedef struct {
+    char *path; /* Relative to the root of the walk. */
+    uint64_t hash;
+} entry_t;
+
+/* The regular files in a tree, sorted by path. */
+typedef struct {
+    entry_t *entries;
+    size_t count;
+} snapshot_t;
+
+/* A directory to build in apart from the working directory. */
+typedef struct {
+    char *dir; /* Ours to remove, as seen from here. */
+    char *tree; /* Where builds run, as seen from the holder's namespaces. */
+    char *view; /* Where to find what they leave, as seen from here. */
+    pid_t holder; /* Keeping an overlay mounted, or 0 for a copy. */
+    int hold; /* Closing this lets the holder go. */
+} sandbox_t;
+
+/* The last RING_SIZE bytes a command wrote, oldest first from
+ * written % RING_SIZE once it has wrapped around.
+ */
+#define RING_SIZE (16 * 1024)
+typedef struct {
+    char data[RING_SIZE];
+    size_t written; /* In total. */
+} ring_t;
+
+/* What we know about a file without reading it. */
+typedef struct {
+    char *path;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime, ctime;
+    int present; /* Whether it was still there when we looked. */
+} meta_t;
+
+/* The files in a tree, sorted by path. */
+typedef struct {
+    meta_t *entries;
+    size_t count;
+} scan_t;
+
+/* A directory as we last read it. */
+typedef struct {
+    char *path; /* "" for the root. */
+    ino_t ino;
+    struct timespec mtime, ctime;
+    time_t read; /* When we read it. */
+    strings_t files; /* Paths of its regular files and links, which we own. */
+    strings_t dirs; /* Paths of its subdirectories, which we own. */
+    int moved; /* Whether a newer index has taken it over. */
+} dir_t;
+
+/* Every directory in a tree, sorted by path. */
+typedef struct {
+    dir_t *dirs;
+    size_t count;
+} dir_index_t;
+
+/* A probe recorded in the journal. */
+typedef struct {
+    char *target;
+    char *file;
+    int rebuilt;
+} record_t;
+
+/* The journal we are writing, and what we read from it when resuming. */
+typedef struct {
+    FILE *file;
+    unsigned int pending; /* Records written since the last sync. */
+    time_t synced; /* When we last synced. */
+    record_t *probes; /* Sorted by target and file. */
+    size_t nprobes;
+    list_t *done; /* Targets an earlier run finished with. */
+} journal_t;
+
+/* What earlier runs measured of a target. */
+typedef struct {
+    char *target;
+    double seconds; /* To build from scratch, or < 0 if never timed. */
+    unsigned int builds; /* How many builds that is an average of. */
+    long deps; /* Dependencies found when last probed, or -1. */
+} cost_t;
+
+/* The profile we keep, sorted by target. */
+typedef struct {
+    cost_t *costs;
+    size_t count;
+} profile_t;
+
+/* How busy the machine was at the last tick, and how many workers we let
+ * build at once because of it.
+ */
+typedef struct {
+    unsigned int ceiling; /* The most workers. */
+    unsigned int weight; /* Tasks each worker's builds may run at once. */
+    double max_load; /* Runnable tasks we may bring the machine up to. */
+    double max_stall; /* Percent of a tick anything may stall. */
+    unsigned int limit;
+    unsigned int since; /* Ticks since limit last changed. */
+    struct timespec then;
+    long long totals[3]; /* Stall times for CPU, memory and IO, or -1. */
+    double stall, memory; /* Percent of the last tick. */
+    double runnable; /* Smoothed, or -1 before the first reading. */
+    double average; /* The kernel's one minute load average. */
+} governor_t;
+
+/* Seconds between readings. */
+#define TICK 1
+
+/* A directory we keep open, by its path including the final slash. */
+typedef struct {
+    char *dir; /* NULL for an empty slot. */
+    int fd; /* -1 if it isn't there. */
+} dir_fd_t;
+
+/* The directories we keep open, as a hash table of them by path. */
+typedef struct {
+    dir_fd_t *slots;
+    size_t size; /* A power of 2. */
+    size_t count;
+    size_t cap; /* The most we'll keep. */
+} dir_fds_t;
+
+/* A path as a directory descriptor and the name of something in it. */
+typedef struct {
+    int fd;
+    const char *leaf;
+} at_t;
+
+/* A candidate's timestamps from before we first touched it. */
+typedef struct {
+    const char *path; /* Shared with the candidate. */
+    struct timespec times[2]; /* Access and modification. */
+    time_t stamped; /* What we last set both to, or 0 if they're as found. */
+} saved_times_t;
+
+/* A library context. */
+struct scrutineer {
+    const backend_t *backend;
+    char **build; /* With a place for the target at build[target_arg]. */
+    unsigned int target_arg;
+    char **clean;
+    list_t *targets;
+    list_t *dependencies;
+    strings_t makefiles;
+    unsigned int strategy;
+    unsigned int sample; /* Candidates outside the prefilter to probe. */
+    unsigned int seed; /* For choosing which. */
+    char *shim;
+    unsigned int timeout; /* Seconds a build may take, or 0. */
+    unsigned int retries; /* Further tries after a build times out. */
+    unsigned int budget; /* Seconds a run may take, or 0. */
+    unsigned int estimate; /* Candidates to sample per target, or 0. */
+    time_t deadline; /* When the run in progress has to stop, or 0. */
+
+    /* Whether we have counted recent changes to the candidates. */
+    int churned;
+
+    /* With SCRUTINEER_CONTENT, the descriptor of the file the shim notes
+     * the recipes it runs in, or -1, and what we last saw of the target.
+     */
+    int marker;
+    int marker_tried;
+    char *marker_shell; /* SHELL=<the shim>, for make. */
+    ino_t noted_ino;
+    off_t noted_size;
+    uint64_t noted_hash; /* Only kept up to date without a marker. */
+
+    /* Whether to look for what each build writes, the directories we saw
+     * last time, and what the builds of the target in hand wrote.
+     */
+    int side_outputs;
+    dir_index_t index;
+    strings_t wrote;
+
+    scrutineer_edge_fn on_edge;
+    void *edge_data;
+    scrutineer_progress_fn on_progress;
+    void *progress_data;
+
+    /* Set while re-assessing a target whose changes we will report
+     * ourselves, to stop each dependency being reported as it is found.
+     */
+    int quiet;
+
+    /* Set when a build times out for good, or we run out of time, until
+     * we've finished with the target it was building.
+     */
+    int timed_out;
+
+    /* The end of what the last build wrote, to show if it failed. */
+    ring_t output;
+
+    char *journal_path;
+    int resume;
+    journal_t journal;
+
+    /* Where to keep what builds cost, and what we know so far. */
+    char *profile_path;
+    profile_t profile;
+
+    /* The candidates' own timestamps, sorted by path, to put back when
+     * we're done with them.
+     */
+    saved_times_t *saved;
+    size_t nsaved;
+
+    /* The directories of the files we've looked at or touched. */
+    dir_fds_t dir_fds;
+
+    /* With the working directory staged, the copy we build in, where we
+     * came from, and the process that will remove the copy once we close
+     * gone.
+     */
+    char *stage;
+    char *home;
+    pid_t sweeper;
+    int gone;
+
+    /* How many targets the parallel check checks at once, or at most if
+     * adapting to the load, when it keeps the machine below max_load
+     * runnable tasks (0 for one per CPU) and stalled on a resource for less
+     * than max_stall percent of the time (0 for the default).
+     */
+    unsigned int workers;
+    int adaptive;
+    unsigned int max_load;
+    unsigned int max_stall;
+
+    /* Whether overlays failed us, so sandboxes have to be copies. Workers
+     * may find out at once.
+     */
+    _Atomic(int) copy_sandboxes;
+
+    /* Whether the defaults have been filled in and the tree cleaned. */
+    int prepared;
+
+    /* Where DIE returns to, and what it said. */
+    jmp_buf *jmp;
+    char error[1024];
+};
+
+/* The context of the library call in progress on this thread, if any. */
+extern _Thread_local scrutineer_t *scrutineer_current;
+
+/* Where DIE returns to on a worker thread, which can't return to the library
+ * call's context on another thread, and what it said.
+ */
+typedef struct {
+    jmp_buf jmp;
+    char error[1024];
+    /* Where warnings go instead of to the context's callback, if set. */
+    void (*warn)(void *data, const char *message);
+    void *warn_data;
+} escape_t;
+extern _Thread_local escape_t *scrutineer_escape;
+
+/* Every library call that can fail starts with ENTER and leaves through
+ * LEAVE, so DIE has somewhere to return to.
+ */
+#define ENTER(s) \
+    jmp_buf jmp_; \
+    scrutineer_t *const saved_ = enter((s), &jmp_); \
+    if (setjmp(jmp_)) { \
+        scrutineer_current = saved_; \
+        return -1; \
+    }
+#define LEAVE() (scrutineer_current = saved_)
+
+#ifdef __GNUC__
+    void die(const char *format, ...)
+        __attribute__((noreturn, format(printf, 1, 2)));
+    void warn(const char *format, ...) __attribute__((format(printf, 1, 2)));
+    #ifndef _GNU_SOURCE
+    /* See comment about _GNU_SOURCE in util.c. */
+    char *strndup(const char *s, size_t n) __attribute__((pure));
+    #endif
+    char **split(const char *s) __attribute__((pure));
+#else
+    void die(const char *format, ...);
+    void warn(const char *format, ...);
+    #ifndef _GNU_SOURCE
+    char *strndup(const char *s, size_t n);
+    #endif
+    char **split(const char *s);
+#endif
+
+/* util.c */
+scrutineer_t *enter(scrutineer_t *s, jmp_buf *jmp);
+void progress(scrutineer_t *s, scrutineer_event_t event, const char *target,
+    const char *detail);
+int touch(const char *path, const time_t timestamp);
+int exists(const char *path);
+void note_stamp(const char *path, time_t timestamp);
+void save_times(scrutineer_t *s);
+void restore_times(scrutineer_t *s);
+time_t get_mtime(const char *path);
+void append(strings_t *v, const char *s);
+int contains(const strings_t *v, const char *s);
+char **with_target(char **argv, unsigned int *target_arg);
+time_t get_now(time_t not);
+char *join(const char *a, const char *b);
+const char *normalise(const char *path);
+size_t dir_len(const char *path);
+int compare_strings(const void *a, const void *b);
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len);
+int hash_file(const char *path, uint64_t *hash);
+
+/* Returns 1 if the directory entry name is "." or "..". */
+static inline int is_dot(const char *name) {
+    return name[0] == '.' &&
+           (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/* run.c */
+#define RUN_TIMED_OUT (-1)
+int run_in(const char *dir, char *const argv[], unsigned int timeout,
+    ring_t *output);
+int run_within(pid_t holder, const char *dir, char *const argv[],
+    unsigned int timeout, ring_t *output);
+char *ring_text(const ring_t *ring);
+int run(char *const argv[]);
+char *run_output(char *const argv[]);
+char **command(char *const *tool, unsigned int tool_len,
+    const char *const *args, unsigned int nargs);
+
+/* tree.c */
+int copy_file(const char *from, const char *to, const struct stat *st);
+int copy_tree(const char *from, const char *to, const struct stat *skip);
+unsigned long long tree_size(const char *path);
+int remove_tree(const char *path);
+snapshot_t snapshot(const char *root);
+void free_snapshot(snapshot_t *s);
+const entry_t *find_entry(const snapshot_t *s, const char *path);
+unsigned int compare_outputs(const snapshot_t *pristine, const snapshot_t *a,
+    const snapshot_t *b, strings_t *differences);
+
+/* pool.c */
+typedef struct posted {
+    _Atomic(struct posted*) next;
+} posted_t;
+typedef struct pool pool_t;
+typedef void (*task_fn)(pool_t *pool, void *task, unsigned int worker,
+    void *data);
+pool_t *start_pool(unsigned int workers, unsigned int active, task_fn fn,
+    void *data, void *const *tasks, size_t n);
+void pool_limit(pool_t *pool, unsigned int active);
+void pool_spawn(pool_t *pool, unsigned int worker, void *task);
+void pool_post(pool_t *pool, posted_t *item);
+posted_t *pool_collect(pool_t *pool, unsigned int timeout);
+int pool_done(const pool_t *pool);
+void finish_pool(pool_t *pool);
+
+/* govern.c */
+unsigned int start_governor(governor_t *g, const scrutineer_t *s,
+    unsigned int ceiling, unsigned int weight);
+unsigned int govern(governor_t *g);
+
+/* sandbox.c */
+void open_sandbox(scrutineer_t *s, const char *root, const char *name,
+    sandbox_t *sb);
+int enter_sandbox(pid_t holder);
+int run_sandboxed(const sandbox_t *sb, char *const argv[],
+    unsigned int timeout, ring_t *output);
+void close_sandbox(sandbox_t *sb);
+
+/* stage.c */
+void stage(scrutineer_t *s, const char *dir);
+void unstage(scrutineer_t *s);
+char *from_home(const scrutineer_t *s, const char *path);
+
+/* content.c */
+char **mark_recipes(scrutineer_t *s);
+void unmark_recipes(scrutineer_t *s, char **argv);
+void close_marker(scrutineer_t *s);
+void note_target(scrutineer_t *s, const char *target);
+int changed_anyway(scrutineer_t *s, const char *target);
+
+/* dirfd.c */
+at_t path_at(const char *path);
+int path_moved(const char *path, at_t *at);
+void close_dirs(dir_fds_t *d);
+
+/* batch.c */
+void stat_all(meta_t *entries, size_t n);
+void touch_all(const char *const *paths, size_t n, time_t timestamp,
+    int *errors);
+int *touch_list(const list_t *files, time_t timestamp);
+
+/* scan.c */
+scan_t scan(dir_index_t *index);
+void free_scan(scan_t *sc);
+void free_index(dir_index_t *index);
+void compare_scans(const scan_t *before, const scan_t *after,
+    strings_t *wrote);
+
+/* depfile.c */
+void add_rule(depfiles_t *d, const char *target, char **prereqs, size_t n);
+void read_depfile(const char *path, depfiles_t *d);
+void find_depfiles(const char *dir, time_t since, depfiles_t *d);
+void free_depfiles(depfiles_t *d);
+const char **prior(depfiles_t *d, const char *target, size_t *n);
+
+/* database.c */
+int read_database(char *const *tool, unsigned int tool_len,
+    const char *const *targets, size_t n, database_t *db);
+void free_database(database_t *db);
+int reachable_rules(database_t *db, const char *target, depfiles_t *d);
+int rule_graph(database_t *db, const char *target, depfiles_t *d);
+
+/* journal.c */
+void open_journal(scrutineer_t *s, const char *path, int resume);
+void close_journal(journal_t *j);
+void journal_probe(journal_t *j, const char *target, const char **files,
+    size_t n, int rebuilt);
+void journal_target(journal_t *j, const list_t *p);
+int journal_lookup(const journal_t *j, const char *target, const char *file);
+int journal_resume(scrutineer_t *s, list_t *p);
+
+/* profile.c */
+void read_profile(scrutineer_t *s);
+void write_profile(scrutineer_t *s);
+const cost_t *profile_lookup(const scrutineer_t *s, const char *target);
+void profile_build(scrutineer_t *s, const char *target, double seconds);
+void profile_deps(scrutineer_t *s, const char *target, size_t deps);
+double seconds_since(const struct timespec *start);
+void free_profile(profile_t *pr);
+
+/* backend.c */
+const backend_t *find_backend(const char *name);
+
+/* probe.c */
+int probe(scrutineer_t *s, const char *target, const char **files, size_t n,
+    time_t *old);
+void group_test(scrutineer_t *s, list_t *p, const char **files, size_t n,
+    time_t *old, int known);
+void examine(scrutineer_t *s, list_t *p, list_t *candidates);
+void assess(scrutineer_t *s, list_t *p);
+void show_output(scrutineer_t *s, const char *target);
+void prepare(scrutineer_t *s);
+void start_clock(scrutineer_t *s);
+int out_of_time(const scrutineer_t *s);
+void report_unassessed(const scrutineer_t *s);
+
+/* estimate.c */
+void estimate(scrutineer_t *s, list_t *p, list_t *candidates, time_t before,
+    time_t *old);
+
+/* reverse.c */
+void reverse(scrutineer_t *s);
+
+/* order.c */
+list_t *order_candidates(scrutineer_t *s, const list_t *p,
+    const list_t *candidates);
+
+/* parallel.c */
+void check_parallel(scrutineer_t *s, unsigned int jobs, unsigned int rounds,
+    unsigned int jitter);
+char *find_program(const char *name);
+
+/* graph.c */
+void save_graph(const char *path, const list_t *targets,
+    const list_t *dependencies);
+list_t *find_target(list_t *targets, const char *name);
+void assess_changes(scrutineer_t *s, const char *range, const char *graph);
+
+/* watch.c */
+void watch(scrutineer_t *s);
+
+#endif
@@ -0,0 +1,322 @@
+/* A journal of the probes we have done, so an interrupted run can carry on
+ * where it left off.
+ *
+ * The journal is a text file of tab separated records, appended to as we go:
+ *
+ *     mtime <seconds> <nanoseconds> <candidate>
+ *     probe <0 or 1> <target> <candidate>
+ *     done <status> <target> <dependencies...>
+ *
+ * The mtime records come first and describe the candidates as they were
+ * before we touched anything. A probe record says whether touching a single
+ * candidate (or a group of candidates, when the answer is 0) rebuilt the
+ * target, and a done record is written when a target is finished with.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "internal.h"
+
+/* The first line of a journal. */
+#define JOURNAL_HEADER "# scrutineer journal 1"
+
+/* How many records we let build up, or for how many seconds, before making
+ * sure they are on disk. Syncing every record would cost more than some
+ * probes do.
+ */
+#define SYNC_RECORDS 64
+#define SYNC_SECONDS 1
+
+static const char *const statuses[] = {
+    "unassessed", "assessed", "phony", "dirty", "failed",
+};
+
+static int compare_records(const void *a, const void *b) {
+    const record_t *x = (const record_t*)a, *y = (const record_t*)b;
+    int c = strcmp(x->target, y->target);
+    return c ? c : strcmp(x->file, y->file);
+}
+
+/* Split a line into tab separated fields in place. The last field gets
+ * whatever is left of the line.
+ */
+static size_t fields(char *line, char **out, size_t max) {
+    size_t n = 0;
+
+    while (n < max) {
+        char *tab = strchr(line, '\t');
+
+        out[n++] = line;
+        if (!tab || n == max)
+            break;
+        *tab = '\0';
+        line = tab + 1;
+    }
+    return n;
+}
+
+/* Put the candidates' timestamps back the way they were when the journal was
+ * started.
+ */
+static void restore_mtimes(const char *path, FILE *f) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    rewind(f);
+    while ((len = getline(&line, &cap, f)) >= 0) {
+        char *field[4];
+
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (fields(line, field, 4) == 4 && !strcmp(field[0], "mtime")) {
+            struct timespec t[2];
+
+            t[0].tv_sec = 0;
+            t[0].tv_nsec = UTIME_OMIT;
+            t[1].tv_sec = (time_t)strtoll(field[1], NULL, 10);
+            t[1].tv_nsec = strtol(field[2], NULL, 10);
+            if (exists(field[3]) && utimensat(AT_FDCWD, field[3], t, 0))
+                warn("Failed to restore the timestamp of %s from %s.\n",
+                    field[3], path);
+        }
+    }
+    free(line);
+}
+
+/* Read the records of an earlier run. Returns where the last whole record
+ * ends.
+ */
+static off_t read_journal(scrutineer_t *s, const char *path, FILE *f) {
+    journal_t *j = &s->journal;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    off_t end;
+
+    len = getline(&line, &cap, f);
+    if (len < 0 || line[len - 1] != '\n' ||
+            strncmp(line, JOURNAL_HEADER, strlen(JOURNAL_HEADER))) {
+        free(line);
+        DIE("%s is not a journal written by scrutineer.\n", path);
+    }
+    end = ftello(f);
+
+    while ((len = getline(&line, &cap, f)) >= 0) {
+        char *field[4];
+        size_t n;
+
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        else
+            break; /* We were killed part way through writing this one. */
+        end = ftello(f);
+
+        n = fields(line, field, 4);
+        if (n == 4 && !strcmp(field[0], "probe")) {
+            record_t *r;
+
+            j->probes = (record_t*)realloc(j->probes,
+                sizeof(record_t) * (j->nprobes + 1));
+            if (!j->probes)
+                DIE("Out of memory.\n");
+            r = &j->probes[j->nprobes++];
+            r->rebuilt = !strcmp(field[1], "1");
+            r->target = strdup(field[2]);
+            r->file = strdup(field[3]);
+        } else if (n >= 3 && !strcmp(field[0], "done")) {
+            list_t *p = (list_t*)calloc(1, sizeof(list_t));
+            scrutineer_status_t status;
+            char *dep;
+
+            if (!p)
+                DIE("Out of memory.\n");
+            for (status = SCRUTINEER_UNASSESSED;
+                    status <= SCRUTINEER_FAILED; ++status)
+                if (!strcmp(field[1], statuses[status]))
+                    break;
+            p->value = strdup(field[2]);
+            p->assessed = 1;
+            p->phony = status == SCRUTINEER_PHONY;
+            p->dirty = status == SCRUTINEER_DIRTY;
+            p->failed = status == SCRUTINEER_FAILED;
+            for (dep = n == 4 ? field[3] : NULL; dep; ) {
+                char *tab = strchr(dep, '\t');
+
+                if (tab)
+                    *tab = '\0';
+                append(&p->found, strdup(dep));
+                dep = tab ? tab + 1 : NULL;
+            }
+            p->next = j->done;
+            j->done = p;
+        }
+    }
+    free(line);
+    qsort(j->probes, j->nprobes, sizeof(record_t), compare_records);
+    return end;
+}
+
+/* Make sure everything written so far is on disk. */
+static void sync_journal(journal_t *j) {
+    if (fflush(j->file) || fsync(fileno(j->file)))
+        DIE("Failed to write the journal.\n");
+    j->pending = 0;
+    j->synced = time(NULL);
+}
+
+/* Note that a record was written, syncing if enough have built up. */
+static void written(journal_t *j) {
+    if (++j->pending >= SYNC_RECORDS || time(NULL) - j->synced >= SYNC_SECONDS)
+        sync_journal(j);
+}
+
+/* Start a journal at path, or carry on with the one there if resuming. */
+void open_journal(scrutineer_t *s, const char *path, int resume) {
+    journal_t *j = &s->journal;
+    list_t *p;
+
+    if (resume) {
+        FILE *f = fopen(path, "r");
+        off_t end;
+
+        if (!f)
+            DIE("Failed to open %s.\n", path);
+        end = read_journal(s, path, f);
+        restore_mtimes(path, f);
+        fclose(f);
+        /* Drop any record we were killed part way through writing, or the
+         * first new one would be joined onto it.
+         */
+        if (end < 0 || truncate(path, end))
+            DIE("Failed to tidy up the end of %s.\n", path);
+        j->file = fopen(path, "a");
+        if (!j->file)
+            DIE("Failed to open %s for writing.\n", path);
+        j->synced = time(NULL);
+        return;
+    }
+
+    j->file = fopen(path, "w");
+    if (!j->file)
+        DIE("Failed to open %s for writing.\n", path);
+    fprintf(j->file, "%s\n", JOURNAL_HEADER);
+    for (p = s->dependencies; p; p = p->next) {
+        struct stat st;
+
+        if (!stat(p->value, &st))
+            fprintf(j->file, "mtime\t%lld\t%ld\t%s\n",
+                (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+                p->value);
+    }
+    sync_journal(j);
+}
+
+void close_journal(journal_t *j) {
+    size_t i;
+    list_t *p;
+
+    if (j->file) {
+        (void)fflush(j->file);
+        (void)fsync(fileno(j->file));
+        fclose(j->file);
+    }
+    for (i = 0; i < j->nprobes; ++i) {
+        free(j->probes[i].target);
+        free(j->probes[i].file);
+    }
+    free(j->probes);
+    while (j->done) {
+        p = j->done->next;
+        for (i = 0; i < j->done->found.count; ++i)
+            free((char*)j->done->found.items[i]);
+        free(j->done->found.items);
+        free((char*)j->done->value);
+        free(j->done);
+        j->done = p;
+    }
+    memset(j, 0, sizeof(*j));
+}
+
+/* Record the result of a probe. A group that rebuilt the target tells us
+ * nothing about its members on their own, so isn't recorded.
+ */
+void journal_probe(journal_t *j, const char *target, const char **files,
+        size_t n, int rebuilt) {
+    size_t i;
+
+    if (!j->file || (rebuilt && n > 1))
+        return;
+    for (i = 0; i < n; ++i)
+        fprintf(j->file, "probe\t%d\t%s\t%s\n", rebuilt, target, files[i]);
+    written(j);
+}
+
+/* Record that we've finished with a target. */
+void journal_target(journal_t *j, const list_t *p) {
+    scrutineer_status_t status = p->phony ? SCRUTINEER_PHONY :
+        p->dirty ? SCRUTINEER_DIRTY : p->failed ? SCRUTINEER_FAILED :
+        SCRUTINEER_ASSESSED;
+    size_t i;
+
+    if (!j->file)
+        return;
+    fprintf(j->file, "done\t%s\t%s", statuses[status], p->value);
+    for (i = 0; i < p->found.count; ++i)
+        fprintf(j->file, "\t%s", p->found.items[i]);
+    fprintf(j->file, "\n");
+    sync_journal(j);
+}
+
+/* Look up what an earlier run found when probing a single candidate.
+ * Returns 1 if it rebuilt target, 0 if not or -1 if we don't know.
+ */
+int journal_lookup(const journal_t *j, const char *target, const char *file) {
+    const record_t key = { (char*)target, (char*)file, 0 };
+    const record_t *r = (const record_t*)bsearch(&key, j->probes, j->nprobes,
+        sizeof(record_t), compare_records);
+
+    return r ? r->rebuilt : -1;
+}
+
+/* If an earlier run finished with target, take its results from there.
+ * Returns 1 if it did. A target that failed, perhaps because its build timed
+ * out, gets another go.
+ */
+int journal_resume(scrutineer_t *s, list_t *p) {
+    const list_t *done;
+    const list_t *p1;
+    size_t i;
+
+    for (done = s->journal.done; done; done = done->next)
+        if (!strcmp(done->value, p->value))
+            break;
+    if (!done || done->failed)
+        return 0;
+
+    progress(s, SCRUTINEER_TARGET_START, p->value, NULL);
+    p->assessed = 1;
+    p->phony = done->phony;
+    p->dirty = done->dirty;
+    p->failed = done->failed;
+    free(p->found.items);
+    p->found.items = NULL;
+    p->found.count = 0;
+    for (i = 0; i < done->found.count; ++i)
+        for (p1 = s->dependencies; p1; p1 = p1->next)
+            if (!strcmp(p1->value, done->found.items[i])) {
+                append(&p->found, p1->value);
+                if (s->on_edge)
+                    s->on_edge(s->edge_data, p->value, p1->value, 1);
+                break;
+            }
+    progress(s, SCRUTINEER_TARGET_DONE, p->value, NULL);
+    return 1;
+}
@@ -0,0 +1,159 @@
+/* Choosing the order to probe candidates in, so that if a run is cut short
+ * the dependencies it has already found are the likeliest ones.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+/* What makes a candidate look like a dependency, most telling first. */
+#define NAMED 4 /* It is named in the commands that build the target. */
+#define STEM 2 /* It has the target's name, give or take an extension. */
+#define NEARBY 1 /* It is in the same directory as the target. */
+
+/* How many recent commits to count changes to candidates over. */
+#define CHURN_COMMITS "200"
+
+typedef struct {
+    const list_t *p;
+    unsigned int score;
+    size_t position; /* Where it was given to us, counting from the first. */
+} ranked_t;
+
+/* Most likely first, otherwise in the order we were given them. */
+static int compare_ranked(const void *a, const void *b) {
+    const ranked_t *x = (const ranked_t*)a, *y = (const ranked_t*)b;
+
+    if (x->score != y->score)
+        return x->score > y->score ? -1 : 1;
+    if (x->p->churn != y->p->churn)
+        return x->p->churn > y->p->churn ? -1 : 1;
+    return x->position < y->position ? -1 : x->position > y->position;
+}
+
+/* Count how many recent commits touched each candidate. Files that change
+ * often are more likely to be edited next, so their edges matter more.
+ * Outside a git repository this finds nothing.
+ */
+static void count_churn(scrutineer_t *s) {
+    char *argv[] = { "git", "log", "-n", CHURN_COMMITS, "--format=",
+        "--name-only", "--relative", NULL };
+    strings_t changed = { NULL, 0 };
+    char *out, *line;
+    list_t *p;
+
+    s->churned = 1;
+    out = run_output(argv);
+    if (!out)
+        return;
+    for (line = strtok(out, "\n"); line; line = strtok(NULL, "\n"))
+        append(&changed, line);
+    qsort(changed.items, changed.count, sizeof(char*), compare_strings);
+
+    for (p = s->dependencies; p; p = p->next) {
+        const char *f = normalise(p->value);
+        const char **hit = (const char**)bsearch(&f, changed.items,
+            changed.count, sizeof(char*), compare_strings);
+        const char **end = changed.items + changed.count;
+
+        if (!hit)
+            continue;
+        while (hit > changed.items && !strcmp(hit[-1], f))
+            --hit;
+        for (; hit < end && !strcmp(*hit, f); ++hit)
+            ++p->churn;
+    }
+    free(changed.items);
+    free(out);
+}
+
+/* Returns 1 if path appears in text as a word of its own. */
+static int named(const char *text, const char *path) {
+    size_t len = strlen(path);
+    const char *at;
+
+    if (len == 0)
+        return 0;
+    for (at = strstr(text, path); at; at = strstr(at + 1, path)) {
+        char before = at == text ? ' ' : at[-1], after = at[len];
+
+        if (!isalnum((unsigned char)before) && !strchr("_.-/", before) &&
+                !isalnum((unsigned char)after) && !strchr("_.-/", after))
+            return 1;
+    }
+    return 0;
+}
+
+/* The length of the file name in path, less any extension. */
+static size_t stem_len(const char *path) {
+    const char *name = path + dir_len(path), *dot = strrchr(name, '.');
+
+    return dot && dot != name ? (size_t)(dot - name) : strlen(name);
+}
+
+/* Return a new list of candidates in the order p should probe them in,
+ * sharing its values with candidates.
+ */
+list_t *order_candidates(scrutineer_t *s, const list_t *p,
+        const list_t *candidates) {
+    const char *target = normalise(p->value), *recipe = NULL;
+    char *commands = NULL;
+    ranked_t *ranked;
+    const list_t *p1;
+    list_t *ordered = NULL;
+    size_t n = 0, i;
+
+    for (p1 = candidates; p1; p1 = p1->next)
+        ++n;
+    if (n == 0)
+        return NULL;
+
+    if (!s->churned)
+        count_churn(s);
+    if (s->backend->recipe) {
+        commands = s->backend->recipe(s->build, s->target_arg, p->value);
+        recipe = commands;
+    }
+
+    ranked = (ranked_t*)malloc(sizeof(ranked_t) * n);
+    if (!ranked)
+        DIE("Out of memory.\n");
+    /* Candidates are added to the front of their list, so the last one is
+     * the first we were given.
+     */
+    for (p1 = candidates, i = 0; p1; p1 = p1->next, ++i) {
+        const char *f = normalise(p1->value);
+        ranked_t *r = &ranked[i];
+
+        r->p = p1;
+        r->position = n - 1 - i;
+        r->score = 0;
+        if (recipe && named(recipe, f))
+            r->score += NAMED;
+        if (stem_len(f) == stem_len(target) &&
+                !strncmp(f + dir_len(f), target + dir_len(target),
+                    stem_len(f)))
+            r->score += STEM;
+        if (dir_len(f) == dir_len(target) &&
+                !strncmp(f, target, dir_len(f)))
+            r->score += NEARBY;
+    }
+    free(commands);
+
+    qsort(ranked, n, sizeof(ranked_t), compare_ranked);
+    for (i = n; i-- > 0; ) {
+        list_t *temp = (list_t*)calloc(1, sizeof(list_t));
+
+        if (!temp)
+            DIE("Out of memory.\n");
+        temp->value = ranked[i].p->value;
+        temp->churn = ranked[i].p->churn;
+        temp->next = ordered;
+        ordered = temp;
+    }
+    free(ranked);
+    return ordered;
+}
@@ -0,0 +1,404 @@
+/* The parallel safety check.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <assert.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+
+/* When the parallel check runs a build, make is told to use the shim as its
+ * SHELL with SCRUTINEER_JITTER set. The shim waits a random interval of up to
+ * that many microseconds to perturb the order in which recipes run and then
+ * hands over to the real shell.
+ */
+int scrutineer_shim(char **argv) {
+    const char *shell, *jitter, *marker;
+    unsigned long limit;
+    struct timespec t;
+
+    /* Note the target whose recipe this is for a build under
+     * SCRUTINEER_CONTENT, which has make pass it to us first.
+     */
+    marker = getenv("SCRUTINEER_MARKER");
+    if (marker && argv[1]) {
+        int fd = atoi(marker);
+        size_t len = strlen(argv[1]);
+        char *line = (char*)malloc(len + 2);
+
+        if (line) {
+            memcpy(line, argv[1], len);
+            line[len] = '\n';
+            /* One write, so lines from parallel recipes don't mix. */
+            (void)!write(fd, line, len + 1);
+            free(line);
+        }
+        ++argv;
+    }
+
+    jitter = getenv("SCRUTINEER_JITTER");
+    limit = jitter ? strtoul(jitter, NULL, 10) : 0;
+    if (limit) {
+        (void)clock_gettime(CLOCK_MONOTONIC, &t);
+        srand((unsigned int)(t.tv_nsec ^ getpid()));
+        usleep((useconds_t)(rand() % limit));
+    }
+
+    shell = getenv("SCRUTINEER_SHELL");
+    if (!shell)
+        shell = "/bin/sh";
+    argv[0] = (char*)shell;
+    (void)execv(shell, argv);
+    fprintf(stderr, "Failed to execute %s.\n", shell);
+    return -1;
+}
+
+/* Find a program in the PATH. The caller owns the result. */
+char *find_program(const char *name) {
+    const char *path = getenv("PATH"), *end;
+
+    for (; path && *path; path = *end ? end + 1 : end) {
+        char *dir, *candidate;
+
+        end = strchr(path, ':');
+        if (!end)
+            end = path + strlen(path);
+        dir = end == path ? strdup(".") : strndup(path, end - path);
+        candidate = join(dir, name);
+        free(dir);
+        if (!access(candidate, X_OK))
+            return candidate;
+        free(candidate);
+    }
+    return NULL;
+}
+
+/* What the workers share. */
+typedef struct {
+    scrutineer_t *s;
+    const char *root;
+    char **pbuild; /* The parallel build, with the target at target_arg + 2. */
+    const char *jobs_arg;
+    unsigned int rounds;
+    snapshot_t pristine;
+} check_t;
+
+/* One target's check, which is done once all its rounds are. */
+typedef struct {
+    const char *target;
+    snapshot_t serial;
+    double seconds; /* How long the serial build took, or < 0. */
+    double expect; /* How long the profile says it will, or < 0. */
+    atomic_uint pending; /* Rounds yet to finish. */
+    _Atomic(char*) verdict; /* Set by the first round to find a problem. */
+} target_check_t;
+
+/* A build for a worker to do: the serial one, or a parallel round. */
+typedef struct {
+    target_check_t *t;
+    int serial;
+} job_t;
+
+/* Something for the calling thread to pass on to the progress callback. */
+typedef struct {
+    posted_t posted; /* First, so a posted_t is one of these. */
+    scrutineer_event_t event;
+    const char *target;
+    char *detail;
+} report_t;
+
+static void report(pool_t *pool, scrutineer_event_t event, const char *target,
+        const char *detail) {
+    report_t *r = (report_t*)calloc(1, sizeof(report_t));
+
+    if (!r || (detail && !(r->detail = strdup(detail)))) {
+        free(r);
+        DIE("Out of memory.\n");
+    }
+    r->event = event;
+    r->target = target;
+    pool_post(pool, &r->posted);
+}
+
+static void report_warning(void *pool, const char *message) {
+    report((pool_t*)pool, SCRUTINEER_WARNING, NULL, message);
+}
+
+/* Set up a new sandbox under root from the current (clean) directory and
+ * build target there with the given command. Returns the build's exit status,
+ * or RUN_TIMED_OUT, and fills in a snapshot of the result and, if asked, how
+ * long the build took.
+ */
+static int sandbox_build(scrutineer_t *s, const char *root, const char *name,
+        char *const *build, unsigned int target_arg, const char *target,
+        snapshot_t *result, double *seconds) {
+    struct timespec start;
+    sandbox_t sb;
+    char **argv;
+    unsigned int i;
+    int ret;
+
+    /* Other workers are using build too. */
+    for (i = target_arg + 1; build[i]; ++i);
+    argv = (char**)malloc(sizeof(char*) * (i + 1));
+    if (!argv)
+        DIE("Out of memory.\n");
+    memcpy(argv, build, sizeof(char*) * (i + 1));
+    argv[target_arg] = (char*)target;
+
+    open_sandbox(s, root, name, &sb);
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = run_sandboxed(&sb, argv, s->timeout, NULL);
+    if (seconds)
+        *seconds = seconds_since(&start);
+    *result = snapshot(sb.view);
+    close_sandbox(&sb);
+    free(argv);
+    return ret;
+}
+
+/* What a parallel build of target found wrong, or NULL. */
+static char *try_round(check_t *c, target_check_t *t, const char *name) {
+    strings_t differences = { NULL, 0 };
+    snapshot_t parallel;
+    char *verdict = NULL;
+    int ret;
+
+    ret = sandbox_build(c->s, c->root, name, c->pbuild, c->s->target_arg + 2,
+        t->target, &parallel, NULL);
+    if (ret) {
+        verdict = (char*)malloc(64);
+        if (!verdict)
+            DIE("Out of memory.\n");
+        sprintf(verdict, "%s only with %s",
+            ret == RUN_TIMED_OUT ? "times out" : "fails", c->jobs_arg);
+    } else if (compare_outputs(&c->pristine, &t->serial, &parallel,
+            &differences)) {
+        size_t len = 64, j;
+
+        for (j = 0; j < differences.count; ++j)
+            len += strlen(differences.items[j]) + 1;
+        verdict = (char*)malloc(len);
+        if (!verdict)
+            DIE("Out of memory.\n");
+        sprintf(verdict, "differs with %s:", c->jobs_arg);
+        for (j = 0; j < differences.count; ++j) {
+            strcat(verdict, " ");
+            strcat(verdict, differences.items[j]);
+        }
+    }
+    free(differences.items);
+    free_snapshot(&parallel);
+    return verdict;
+}
+
+/* Do a job on a worker. A serial build that succeeds gives the same worker
+ * the target's parallel rounds, which go to other workers if they're idle.
+ */
+static void do_job(pool_t *pool, void *task, unsigned int worker,
+        void *data) {
+    job_t *job = (job_t*)task;
+    target_check_t *t = job->t;
+    check_t *c = (check_t*)data;
+    char name[32];
+    char *verdict, *none = NULL;
+    unsigned int round;
+    int ret;
+
+    scrutineer_escape->warn = report_warning;
+    scrutineer_escape->warn_data = pool;
+    /* Each worker has one sandbox at a time. */
+    sprintf(name, "worker%u", worker);
+
+    if (job->serial) {
+        free(job);
+        report(pool, SCRUTINEER_TARGET_START, t->target, NULL);
+        ret = sandbox_build(c->s, c->root, name, c->s->build,
+            c->s->target_arg, t->target, &t->serial, &t->seconds);
+        if (ret) {
+            t->seconds = -1;
+            report(pool, SCRUTINEER_VERDICT, t->target,
+                ret == RUN_TIMED_OUT ? "times out serially" : "fails serially");
+            report(pool, SCRUTINEER_TARGET_DONE, t->target, NULL);
+            free_snapshot(&t->serial);
+            return;
+        }
+        atomic_store(&t->pending, c->rounds);
+        for (round = 0; round < c->rounds; ++round) {
+            job = (job_t*)calloc(1, sizeof(job_t));
+            if (!job)
+                DIE("Out of memory.\n");
+            job->t = t;
+            pool_spawn(pool, worker, job);
+        }
+        return;
+    }
+
+    free(job);
+    /* Once one round has found a problem, the rest needn't run. */
+    if (!atomic_load(&t->verdict)) {
+        verdict = try_round(c, t, name);
+        if (verdict && !atomic_compare_exchange_strong(&t->verdict, &none,
+                verdict))
+            free(verdict);
+    }
+    if (atomic_fetch_sub(&t->pending, 1) == 1) {
+        verdict = atomic_load(&t->verdict);
+        report(pool, SCRUTINEER_VERDICT, t->target, verdict ? verdict : "ok");
+        report(pool, SCRUTINEER_TARGET_DONE, t->target, NULL);
+        free_snapshot(&t->serial);
+    }
+}
+
+static int longest_first(const void *a, const void *b) {
+    const target_check_t *x = (*(job_t *const*)a)->t;
+    const target_check_t *y = (*(job_t *const*)b)->t;
+
+    if ((x->expect < 0) != (y->expect < 0))
+        return x->expect < 0 ? -1 : 1;
+    if (x->expect != y->expect)
+        return x->expect > y->expect ? -1 : 1;
+    /* Otherwise as we were given them. */
+    return x < y ? -1 : x > y;
+}
+
+/* Build each target serially and in parallel, in separate sandboxes, and
+ * report any whose outputs differ. This catches missing edges that serial
+ * probing cannot see. Up to s->workers targets are checked at once, those
+ * the profile expects to take longest first.
+ */
+void check_parallel(scrutineer_t *s, unsigned int jobs, unsigned int rounds,
+        unsigned int jitter) {
+    char root[PATH_MAX], jobs_arg[32], jitter_env[32];
+    char *shell_arg, *shim;
+    char **pbuild;
+    unsigned int i;
+    size_t n = 0, j;
+    target_check_t *targets;
+    const cost_t *cost;
+    job_t **tasks;
+    const char *tmp;
+    check_t c;
+    governor_t governor;
+    unsigned int active;
+    pool_t *pool;
+    posted_t *posted;
+    list_t *p;
+
+    /* The parallel build command is the serial one with -jN and our shim
+     * shell added.
+     */
+    shim = s->shim ? strdup(s->shim) : find_program("scrutineer");
+    if (!shim)
+        DIE("Failed to find scrutineer to use as make's SHELL.\n");
+    shell_arg = (char*)malloc(strlen("SHELL=") + strlen(shim) + 1);
+    if (!shell_arg)
+        DIE("Out of memory.\n");
+    sprintf(shell_arg, "SHELL=%s", shim);
+    free(shim);
+    sprintf(jobs_arg, "-j%u", jobs);
+    pbuild = (char**)malloc(sizeof(char*) * (s->target_arg + 4));
+    if (!pbuild)
+        DIE("Out of memory.\n");
+    for (i = 0; i < s->target_arg; ++i)
+        pbuild[i] = s->build[i];
+    pbuild[s->target_arg] = jobs_arg;
+    pbuild[s->target_arg + 1] = shell_arg;
+    pbuild[s->target_arg + 2] = NULL;
+    pbuild[s->target_arg + 3] = NULL;
+    /* Now pbuild[target_arg + 2] is the "target" argument's place. */
+
+    tmp = getenv("TMPDIR");
+    if (!tmp)
+        tmp = "/tmp";
+    if (snprintf(root, sizeof(root), "%s/scrutineer.XXXXXX", tmp) >=
+            (int)sizeof(root) || !mkdtemp(root))
+        DIE("Failed to create a sandbox directory in %s.\n", tmp);
+
+    sprintf(jitter_env, "%u", jitter);
+    if (setenv("SCRUTINEER_JITTER", jitter_env, 1))
+        DIE("Failed to set SCRUTINEER_JITTER.\n");
+
+    c.s = s;
+    c.root = root;
+    c.pbuild = pbuild;
+    c.jobs_arg = jobs_arg;
+    c.rounds = rounds;
+    c.pristine = snapshot(".");
+
+    for (p = s->targets; p; p = p->next)
+        ++n;
+    targets = (target_check_t*)calloc(n ? n : 1, sizeof(target_check_t));
+    tasks = (job_t**)calloc(n ? n : 1, sizeof(job_t*));
+    if (!targets || !tasks)
+        DIE("Out of memory.\n");
+    for (p = s->targets, j = 0; p; p = p->next, ++j) {
+        assert(p->value);
+        targets[j].target = p->value;
+        targets[j].seconds = -1;
+        cost = profile_lookup(s, p->value);
+        targets[j].expect = cost ? cost->seconds : -1;
+        atomic_init(&targets[j].pending, 0);
+        atomic_init(&targets[j].verdict, NULL);
+        tasks[j] = (job_t*)calloc(1, sizeof(job_t));
+        if (!tasks[j])
+            DIE("Out of memory.\n");
+        tasks[j]->t = &targets[j];
+        tasks[j]->serial = 1;
+    }
+
+    /* The longest first, so none of them is left running on its own at the
+     * end. Those we know nothing about might be the longest of all.
+     */
+    qsort(tasks, n, sizeof(job_t*), longest_first);
+
+    /* On a machine we share, build as much at once as it has room for. */
+    active = s->adaptive ? start_governor(&governor, s, s->workers, jobs) :
+        s->workers;
+
+    /* The workers' reports come back here, to go out on this thread. */
+    pool = start_pool(s->workers, active, do_job, &c, (void *const*)tasks, n);
+    free(tasks);
+    for (;;) {
+        report_t *r;
+
+        posted = pool_collect(pool, s->adaptive ? TICK * 1000 : 0);
+        if (s->adaptive && govern(&governor) != active) {
+            active = governor.limit;
+            pool_limit(pool, active);
+        }
+        if (!posted) {
+            if (pool_done(pool))
+                break;
+            continue;
+        }
+        r = (report_t*)posted;
+
+        if (r->event == SCRUTINEER_WARNING)
+            warn("%s\n", r->detail);
+        else
+            progress(s, r->event, r->target, r->detail);
+        free(r->detail);
+        free(r);
+    }
+    finish_pool(pool);
+
+    for (j = 0; j < n; ++j) {
+        if (targets[j].seconds >= 0)
+            profile_build(s, targets[j].target, targets[j].seconds);
+        free(atomic_load(&targets[j].verdict));
+    }
+    free(targets);
+    free_snapshot(&c.pristine);
+    (void)unsetenv("SCRUTINEER_JITTER");
+    if (rmdir(root))
+        warn("failed to remove %s.\n", root);
+    free(pbuild);
+    free(shell_arg);
+}
@@ -0,0 +1,407 @@
+/* A pool of worker threads sharing out tasks that can take wildly different
+ * times, and which may give rise to more tasks as they go.
+ *
+ * Each worker has a deque of its own. It takes its newest task first, so
+ * that follow-up work runs while what it needs is at hand. A worker that runs
+ * out takes the next of the tasks the pool started with, which are handed
+ * out in the order given so the caller can put the longest first. After
+ * those, it takes the oldest task of another, which is likely the one that
+ * leads to the most work. The caller may have only some of the workers take
+ * tasks, and change how many as it goes. Results go back to the calling
+ * thread through a queue that workers add to without taking a lock, and the
+ * caller takes them off in the order they were added.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "internal.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    void **tasks; /* A ring, from first. */
+    size_t first, count, cap;
+} deque_t;
+
+typedef struct {
+    pool_t *pool;
+    unsigned int index;
+    pthread_t thread;
+} worker_t;
+
+struct pool {
+    task_fn fn;
+    void *data;
+    unsigned int nworkers, started;
+    atomic_uint active; /* Workers below this may take tasks. */
+    deque_t *deques;
+    worker_t *workers;
+
+    /* The tasks we started with, up to taken of which have been. */
+    void **initial;
+    size_t ninitial;
+    atomic_size_t taken;
+
+    /* Tasks waiting, and waiting or running. Idle workers sleep on idle
+     * until either changes.
+     */
+    atomic_size_t queued, outstanding;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    unsigned int running; /* Workers yet to exit. */
+    char *error; /* The first task to fail's message. */
+
+    /* Posted results, from tail to head, with a post to ready for each and
+     * one more once the last worker has gone.
+     */
+    _Atomic(posted_t*) head;
+    posted_t *tail;
+    posted_t stub;
+    sem_t ready;
+    atomic_int done;
+    int finished; /* Whether the caller has seen the last result. */
+};
+
+static void push_back(deque_t *d, void *task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 16, i;
+        void **tasks = (void**)malloc(sizeof(void*) * cap);
+
+        if (!tasks) {
+            pthread_mutex_unlock(&d->lock);
+            DIE("Out of memory.\n");
+        }
+        for (i = 0; i < d->count; ++i)
+            tasks[i] = d->tasks[(d->first + i) % d->cap];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->first = 0;
+        d->cap = cap;
+    }
+    d->tasks[(d->first + d->count++) % d->cap] = task;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Take the newest task, as its owner, or the oldest, as a thief. */
+static void *take(deque_t *d, int steal) {
+    void *task = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        if (steal) {
+            task = d->tasks[d->first];
+            d->first = (d->first + 1) % d->cap;
+        } else
+            task = d->tasks[(d->first + d->count - 1) % d->cap];
+        --d->count;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+static void *next_task(pool_t *pool, unsigned int me) {
+    unsigned int i;
+    void *task = take(&pool->deques[me], 0);
+
+    if (!task && atomic_load(&pool->taken) < pool->ninitial) {
+        size_t j = atomic_fetch_add(&pool->taken, 1);
+
+        if (j < pool->ninitial)
+            task = pool->initial[j];
+    }
+    for (i = 1; !task && i < pool->nworkers; ++i)
+        task = take(&pool->deques[(me + i) % pool->nworkers], 1);
+    if (task)
+        atomic_fetch_sub(&pool->queued, 1);
+    return task;
+}
+
+/* Give worker another task, to be run by it unless another worker is idle
+ * first.
+ */
+void pool_spawn(pool_t *pool, unsigned int worker, void *task) {
+    atomic_fetch_add(&pool->outstanding, 1);
+    push_back(&pool->deques[worker], task);
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_lock(&pool->lock);
+    /* Waking just one might wake a worker that may not take it. */
+    if (atomic_load(&pool->active) < pool->nworkers)
+        pthread_cond_broadcast(&pool->idle);
+    else
+        pthread_cond_signal(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Let only the first active workers take tasks from now on, though the rest
+ * finish what they have started.
+ */
+void pool_limit(pool_t *pool, unsigned int active) {
+    if (active < 1)
+        active = 1;
+    if (active > pool->nworkers)
+        active = pool->nworkers;
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->active, active);
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void fail(pool_t *pool, const char *message) {
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->error)
+        pool->error = strdup(message);
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *work(void *arg) {
+    worker_t *w = (worker_t*)arg;
+    pool_t *pool = w->pool;
+    escape_t escape;
+
+    memset(&escape, 0, sizeof(escape));
+    /* DIE from a task comes back here rather than to the caller's context,
+     * which belongs to another thread.
+     */
+    scrutineer_escape = &escape;
+    for (;;) {
+        void *task = w->index < atomic_load(&pool->active) ?
+            next_task(pool, w->index) : NULL;
+
+        if (task) {
+            if (setjmp(escape.jmp)) {
+                fail(pool, escape.error);
+                break;
+            }
+            pool->fn(pool, task, w->index, pool->data);
+            if (atomic_fetch_sub(&pool->outstanding, 1) == 1) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->idle);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->error && atomic_load(&pool->outstanding) > 0 &&
+                (atomic_load(&pool->queued) == 0 ||
+                 w->index >= atomic_load(&pool->active)))
+            pthread_cond_wait(&pool->idle, &pool->lock);
+        if (pool->error || atomic_load(&pool->outstanding) == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    scrutineer_escape = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) {
+        atomic_store(&pool->done, 1);
+        sem_post(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Start workers running fn on each of the n tasks, which they start in
+ * order as they become free, and on any tasks they spawn. Only the first
+ * active workers take tasks, until pool_limit says otherwise. Tasks are
+ * malloced and belong to fn, except that the pool frees any left after one
+ * fails.
+ */
+pool_t *start_pool(unsigned int workers, unsigned int active, task_fn fn,
+        void *data, void *const *tasks, size_t n) {
+    pool_t *pool = (pool_t*)calloc(1, sizeof(pool_t));
+    unsigned int i;
+
+    if (!pool)
+        DIE("Out of memory.\n");
+    if (workers == 0)
+        workers = 1;
+    pool->fn = fn;
+    pool->data = data;
+    pool->nworkers = workers;
+    atomic_init(&pool->active, active < 1 ? 1 : active > workers ? workers :
+        active);
+    pool->deques = (deque_t*)calloc(workers, sizeof(deque_t));
+    pool->workers = (worker_t*)calloc(workers, sizeof(worker_t));
+    if (!pool->deques || !pool->workers)
+        DIE("Out of memory.\n");
+    for (i = 0; i < workers; ++i)
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    atomic_init(&pool->head, &pool->stub);
+    pool->tail = &pool->stub;
+    atomic_init(&pool->stub.next, NULL);
+    if (sem_init(&pool->ready, 0, 0))
+        DIE("Failed to set up a semaphore.\n");
+
+    pool->initial = (void**)malloc(sizeof(void*) * (n ? n : 1));
+    if (!pool->initial)
+        DIE("Out of memory.\n");
+    memcpy(pool->initial, tasks, sizeof(void*) * n);
+    pool->ninitial = n;
+    atomic_init(&pool->taken, 0);
+    atomic_init(&pool->queued, n);
+    atomic_init(&pool->outstanding, n);
+
+    for (i = 0; i < workers; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+    }
+    pool->running = workers;
+    for (i = 0; i < workers; ++i) {
+        if (pthread_create(&pool->workers[i].thread, NULL, work,
+                &pool->workers[i]))
+            break;
+        ++pool->started;
+    }
+    if (pool->started < workers) {
+        /* Make do with the workers we have, which steal the others' tasks,
+         * unless we have none.
+         */
+        pthread_mutex_lock(&pool->lock);
+        pool->running -= workers - pool->started;
+        if (pool->started == 0) {
+            pool->error = strdup("Failed to start a worker thread.");
+            atomic_store(&pool->done, 1);
+            sem_post(&pool->ready);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return pool;
+}
+
+/* Send a result back to the thread that started the pool. Any worker may do
+ * this at any time without waiting for the others.
+ */
+static void enqueue(pool_t *pool, posted_t *item) {
+    posted_t *prev;
+
+    atomic_store_explicit(&item->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&pool->head, item, memory_order_acq_rel);
+    /* Until this, the item is in the queue but can't be reached. */
+    atomic_store_explicit(&prev->next, item, memory_order_release);
+}
+
+void pool_post(pool_t *pool, posted_t *item) {
+    enqueue(pool, item);
+    sem_post(&pool->ready);
+}
+
+/* The oldest item, or NULL if there are none or the oldest is only part way
+ * in.
+ */
+static posted_t *pop(pool_t *pool) {
+    posted_t *tail = pool->tail, *next;
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &pool->stub) {
+        if (!next)
+            return NULL;
+        pool->tail = tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        pool->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&pool->head, memory_order_acquire))
+        return NULL;
+    /* tail is the last item. Put the stub behind it so it can go. */
+    enqueue(pool, &pool->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (!next)
+        return NULL;
+    pool->tail = next;
+    return tail;
+}
+
+/* Wait for the next result, in the order they were posted, for up to
+ * timeout milliseconds if that isn't 0. Returns NULL if there was none in
+ * time, or once the workers have all finished and every result has been
+ * collected, which pool_done tells apart. Only the thread that started the
+ * pool may call this.
+ */
+posted_t *pool_collect(pool_t *pool, unsigned int timeout) {
+    posted_t *item;
+
+    if (pool->finished)
+        return NULL;
+    if (timeout) {
+        struct timespec until;
+
+        (void)clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += timeout / 1000;
+        until.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            ++until.tv_sec;
+            until.tv_nsec -= 1000000000;
+        }
+        while (sem_timedwait(&pool->ready, &until))
+            if (errno != EINTR)
+                return NULL;
+    } else
+        while (sem_wait(&pool->ready) && errno == EINTR);
+    while (!(item = pop(pool))) {
+        /* With everyone gone, nothing can be part way in. */
+        if (atomic_load(&pool->done)) {
+            pool->finished = 1;
+            return NULL;
+        }
+        sched_yield();
+    }
+    return item;
+}
+
+/* Whether pool_collect has returned the last result. */
+int pool_done(const pool_t *pool) {
+    return pool->finished;
+}
+
+/* Wait for the workers, which have to have finished, and tidy up. If a task
+ * failed, fail the same way.
+ */
+void finish_pool(pool_t *pool) {
+    char error[sizeof(((escape_t*)NULL)->error)];
+    unsigned int i;
+    void *task;
+    size_t j;
+
+    for (i = 0; i < pool->started; ++i)
+        pthread_join(pool->workers[i].thread, NULL);
+    error[0] = '\0';
+    if (pool->error) {
+        strncpy(error, pool->error, sizeof(error) - 1);
+        error[sizeof(error) - 1] = '\0';
+    }
+    for (i = 0; i < pool->nworkers; ++i) {
+        while ((task = take(&pool->deques[i], 0)))
+            free(task);
+        free(pool->deques[i].tasks);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    for (j = atomic_load(&pool->taken); j < pool->ninitial; ++j)
+        free(pool->initial[j]);
+    free(pool->initial);
+    free(pool->error);
+    free(pool->workers);
+    free(pool->deques);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->idle);
+    sem_destroy(&pool->ready);
+    free(pool);
+    if (error[0])
+        DIE("%s\n", error);
+}
@@ -0,0 +1,736 @@
+/* Finding the dependencies of a target by touching files and rebuilding it.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "internal.h"
+
+/* Pass on the end of what the last build of target wrote, after it failed.
+ * Without a progress callback to tell, this goes to stderr.
+ */
+void show_output(scrutineer_t *s, const char *target) {
+    char *text, *start;
+    size_t len;
+
+    if (s->output.written == 0)
+        return;
+    text = start = ring_text(&s->output);
+
+    /* If the start was overwritten, skip what's left of its last line. */
+    if (s->output.written > RING_SIZE && strchr(start, '\n'))
+        start = strchr(start, '\n') + 1;
+
+    len = strlen(start);
+    if (s->on_progress)
+        progress(s, SCRUTINEER_OUTPUT, target, start);
+    else
+        fprintf(stderr, "Output of the failed build of %s:\n%s%s", target,
+            start, len > 0 && start[len - 1] != '\n' ? "\n" : "");
+    free(text);
+}
+
+/* Build target, trying again if it takes too long. Returns the exit code
+ * of the build, or RUN_TIMED_OUT if every try timed out, having shown what
+ * the build wrote in either case.
+ */
+static int build(scrutineer_t *s, const char *target) {
+    unsigned int i;
+    int ret = 0;
+    char **argv;
+
+    s->build[s->target_arg] = (char*)target;
+    argv = (s->strategy & SCRUTINEER_CONTENT) ? mark_recipes(s) : s->build;
+    for (i = 0; i <= s->retries; ++i) {
+        unsigned int timeout = s->timeout;
+
+        /* Don't let a build run past the end of the budget. */
+        if (s->deadline) {
+            time_t left = s->deadline - time(NULL);
+
+            if (left < 1)
+                left = 1;
+            if (!timeout || (time_t)timeout > left)
+                timeout = (unsigned int)left;
+        }
+        if (s->side_outputs) {
+            scan_t before = scan(&s->index), after;
+
+            ret = run_in(NULL, argv, timeout, &s->output);
+            after = scan(&s->index);
+            compare_scans(&before, &after, &s->wrote);
+            free_scan(&before);
+            free_scan(&after);
+        } else
+            ret = run_in(NULL, argv, timeout, &s->output);
+        if (ret != RUN_TIMED_OUT || out_of_time(s))
+            break;
+        warn("Building %s timed out after %u seconds%s.\n", target,
+            s->timeout, i < s->retries ? ". Trying again" : "");
+    }
+    unmark_recipes(s, argv);
+    if (ret && !out_of_time(s))
+        show_output(s, target);
+    return ret;
+}
+
+/* Start the clock on a run's budget, if it has one. */
+void start_clock(scrutineer_t *s) {
+    s->deadline = s->budget ? time(NULL) + s->budget : 0;
+}
+
+/* Returns 1 if the run in progress has used up its budget. */
+int out_of_time(const scrutineer_t *s) {
+    return s->deadline && time(NULL) >= s->deadline;
+}
+
+/* Say how many targets running out of time left unassessed. */
+void report_unassessed(const scrutineer_t *s) {
+    const list_t *p;
+    size_t n = 0;
+
+    if (!out_of_time(s))
+        return;
+    for (p = s->targets; p; p = p->next)
+        if (!p->assessed)
+            ++n;
+    if (n > 0)
+        warn("Ran out of time with %zu target%s left to assess.\n", n,
+            n == 1 ? "" : "s");
+}
+
+/* Touch a group of files, rebuild target and return 1 if it was rebuilt or 0
+ * if not. old is the target's current timestamp and is updated when it is
+ * rebuilt. If the build times out or we run out of time, we give up on
+ * target, returning -1, and every later probe of it returns -1 without
+ * building, as we can't tell either way.
+ */
+int probe(scrutineer_t *s, const char *target, const char **files,
+        size_t n, time_t *old) {
+    time_t now, stamp;
+    size_t i;
+    int ret, content = !!(s->strategy & SCRUTINEER_CONTENT);
+
+    assert(n > 0);
+
+    if (s->timed_out)
+        return -1;
+    if (out_of_time(s)) {
+        s->timed_out = 1;
+        return -1;
+    }
+
+    /* An earlier run may already have told us. */
+    if (s->journal.nprobes) {
+        int known = journal_lookup(&s->journal, target, files[0]);
+
+        for (i = 1; known == 0 && i < n; ++i)
+            known = journal_lookup(&s->journal, target, files[i]);
+        if (known == 0 || (known == 1 && n == 1))
+            return known;
+    }
+
+    progress(s, SCRUTINEER_PROBE, target, files[0]);
+    stamp = get_now(*old);
+    assert(stamp > *old);
+    assert(get_mtime(target) == *old);
+    for (i = 0; i < n; ++i) {
+        assert(files[i]);
+        assert(exists(files[i]));
+    }
+    touch_all(files, n, stamp, NULL);
+
+    /* Save ourselves a build if the build system can tell us nothing needs
+     * doing.
+     */
+    if (s->backend->query &&
+            !s->backend->query(s->build, s->target_arg, target)) {
+        journal_probe(&s->journal, target, files, n, 0);
+        return 0;
+    }
+
+    ret = build(s, target);
+    if (ret == RUN_TIMED_OUT) {
+        s->timed_out = 1;
+        return -1;
+    }
+    if (ret) {
+        if (n == 1)
+            DIE("Error: Failed to build %s after touching %s.\n", target,
+                files[0]);
+        DIE("Error: Failed to build %s after touching %s and %zu other "
+            "files.\n", target, files[0], n - 1);
+    }
+
+    if (!exists(target))
+        DIE("Error: %s, that was NOT a phony target, was removed when "
+            "building after touching %s. Broken recipe for %s?\n", target,
+            files[0], target);
+
+    now = get_mtime(target);
+    /* Check we haven't gone back in time, which a recipe that keeps its
+     * target's timestamp can make it do.
+     */
+    assert(now >= *old || content);
+    if (now != *old || (content && changed_anyway(s, target))) {
+        /* The target was rebuilt. */
+        if (content) {
+            /* If it kept an older timestamp, make would now see it as out
+             * of date and every later probe would rebuild it.
+             */
+            if (now < stamp) {
+                if (touch(target, stamp))
+                    DIE("Could not update timestamp for %s.\n", target);
+                now = stamp;
+            }
+            note_target(s, target);
+        }
+        *old = now;
+        journal_probe(&s->journal, target, files, n, 1);
+        return 1;
+    }
+    journal_probe(&s->journal, target, files, n, 0);
+    return 0;
+}
+
+/* Clean up after probing p, noting whether we had to give up on it. */
+static void finish(scrutineer_t *s, list_t *p) {
+    if (s->timed_out) {
+        if (out_of_time(s))
+            warn("Ran out of time while probing %s, so the dependencies "
+                "found for it are incomplete.\n", p->value);
+        else
+            warn("Gave up on %s after a build timed out, so the dependencies "
+                "found for it are incomplete.\n", p->value);
+        p->failed = 1;
+        s->timed_out = 0;
+    }
+    if (run(s->clean))
+        DIE("Error: Clean failed.\n");
+}
+
+/* Note that p depends on dep. */
+static void found(scrutineer_t *s, list_t *p, const char *dep) {
+    append(&p->found, dep);
+    if (!s->quiet && s->on_edge)
+        s->on_edge(s->edge_data, p->value, dep, 1);
+}
+
+/* Find which of a group of files a target depends on by adaptive binary
+ * splitting, noting each one found. If the group is known to
+ * contain a dependency we can skip probing it as a whole. This relies on the
+ * target being rebuilt when any of its dependencies are touched, so touching
+ * a group tells us whether at least one member is a dependency.
+ */
+void group_test(scrutineer_t *s, list_t *p, const char **files, size_t n,
+        time_t *old, int known) {
+    size_t half;
+    int rebuilt;
+
+    if (n == 0)
+        return;
+    if (!known && probe(s, p->value, files, n, old) <= 0)
+        return;
+    if (n == 1) {
+        found(s, p, files[0]);
+        return;
+    }
+
+    half = n / 2;
+    rebuilt = probe(s, p->value, files, half, old);
+    /* If we gave up, we can't say which half it's in. */
+    if (rebuilt < 0)
+        return;
+    if (rebuilt) {
+        group_test(s, p, files, half, old, 1);
+        group_test(s, p, files + half, n - half, old, 0);
+    } else
+        /* The dependency we know about must be in the second half. */
+        group_test(s, p, files + half, n - half, old, 1);
+}
+
+/* Group test files as group_test does, unless the profile says about how
+ * many dependencies p has. Then, rather than start with them all, test them
+ * in batches sized so that each is about as likely to hold a dependency as
+ * not, as in Hwang's generalised binary splitting. This saves the builds
+ * that would go on splitting groups we could tell would rebuild p anyway.
+ */
+static void batch_test(scrutineer_t *s, list_t *p, const char **files,
+        size_t n, time_t *old) {
+    const cost_t *c = profile_lookup(s, p->value);
+    size_t expect, had, size;
+
+    if (!c || c->deps < 0) {
+        group_test(s, p, files, n, old, 0);
+        return;
+    }
+    /* Some may have been found already. */
+    expect = (size_t)c->deps > p->found.count ?
+        (size_t)c->deps - p->found.count : 0;
+
+    while (n > 0 && !s->timed_out && !out_of_time(s)) {
+        if (expect == 0) {
+            /* Any left are a surprise, which one probe will show. */
+            group_test(s, p, files, n, old, 0);
+            return;
+        }
+        if (n + 2 <= 2 * expect)
+            /* So many that each might as well be probed alone. */
+            size = 1;
+        else
+            for (size = 1; size * 2 <= (n - expect + 1) / expect; size *= 2);
+        had = p->found.count;
+        group_test(s, p, files, size, old, 0);
+        had = p->found.count - had;
+        expect = had < expect ? expect - had : 0;
+        files += size;
+        n -= size;
+    }
+}
+
+static list_t *node(const char *value) {
+    list_t *temp = (list_t*)calloc(1, sizeof(list_t));
+
+    if (!temp)
+        DIE("Out of memory.\n");
+    temp->value = value;
+    return temp;
+}
+
+static void free_nodes(list_t *p) {
+    while (p) {
+        list_t *next = p->next;
+        free(p);
+        p = next;
+    }
+}
+
+/* Split candidates into those the build system's rules could lead to from
+ * p and the rest, moving a random sample of up to s->sample of the rest in
+ * with the others. The sample is noted in sampled. The new lists share their
+ * values with candidates. Returns -1 if the build system can't tell us.
+ */
+static int prefilter(scrutineer_t *s, const list_t *p, list_t *candidates,
+        list_t **inside, list_t **outside, strings_t *sampled) {
+    depfiles_t d = { NULL, 0 };
+    const char **reachable;
+    list_t *p1, **in = inside, **out = outside;
+    size_t n, nout = 0, i;
+
+    *inside = *outside = NULL;
+    if (s->backend->reachable(s->build, s->target_arg, p->value, &d)) {
+        free_depfiles(&d);
+        return -1;
+    }
+    reachable = prior(&d, p->value, &n);
+    for (p1 = candidates; p1; p1 = p1->next) {
+        const char *f = normalise(p1->value);
+        list_t *temp = node(p1->value);
+
+        if (bsearch(&f, reachable, n, sizeof(char*), compare_strings)) {
+            *in = temp;
+            in = &temp->next;
+        } else {
+            *out = temp;
+            out = &temp->next;
+            ++nout;
+        }
+    }
+    free(reachable);
+    free_depfiles(&d);
+
+    for (i = 0; i < s->sample && nout > 0; ++i, --nout) {
+        size_t k = (size_t)rand_r(&s->seed) % nout;
+        list_t **q = outside, *temp;
+
+        while (k-- > 0)
+            q = &(*q)->next;
+        temp = *q;
+        *q = temp->next;
+        temp->next = NULL;
+        *in = temp;
+        in = &temp->next;
+        append(sampled, temp->value);
+    }
+    return 0;
+}
+
+/* Work out which of candidates p depends on from the build system's rule
+ * graph instead of building, then check the answer against real builds: the
+ * predicted non-dependencies all at once, and a random sample of up to
+ * s->sample (at least one) of the predicted dependencies one at a time.
+ * Returns 0 if the answer held up and -1 if we need to probe after all.
+ */
+static int evaluate(scrutineer_t *s, list_t *p, list_t *candidates,
+        time_t *old) {
+    depfiles_t d = { NULL, 0 };
+    const char **graph, **yes = NULL, **no = NULL;
+    size_t n, nyes = 0, nno = 0, i, checks;
+    list_t *p1;
+    int ret = 0;
+
+    if (s->backend->graph(s->build, s->target_arg, p->value, &d)) {
+        free_depfiles(&d);
+        warn("%s's rules use something we can't evaluate. Probing "
+            "instead.\n", p->value);
+        return -1;
+    }
+    graph = prior(&d, p->value, &n);
+    for (p1 = candidates; p1; p1 = p1->next) {
+        const char *f = normalise(p1->value);
+        int dep = !!bsearch(&f, graph, n, sizeof(char*), compare_strings);
+        const char ***v = dep ? &yes : &no;
+        size_t *count = dep ? &nyes : &nno;
+
+        *v = (const char**)realloc(*v, sizeof(char*) * (*count + 1));
+        if (!*v)
+            DIE("Out of memory.\n");
+        (*v)[(*count)++] = p1->value;
+    }
+    free(graph);
+    free_depfiles(&d);
+
+    if (nno > 0) {
+        int rebuilt = probe(s, p->value, no, nno, old);
+
+        if (rebuilt > 0)
+            warn("Touching files the rules say %s does not depend on rebuilt "
+                "it. Probing instead.\n", p->value);
+        if (rebuilt)
+            ret = -1;
+    }
+    checks = s->sample ? s->sample : 1;
+    for (i = 0; ret == 0 && i < checks && i < nyes; ++i) {
+        /* Move a random unchecked one to the front. */
+        size_t k = i + (size_t)rand_r(&s->seed) % (nyes - i);
+        const char *f = yes[k];
+
+        yes[k] = yes[i];
+        yes[i] = f;
+        if (probe(s, p->value, &f, 1, old) <= 0) {
+            if (!s->timed_out)
+                warn("The rules say %s depends on %s but touching it does "
+                    "not rebuild it. Probing instead.\n", p->value, f);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+        for (p1 = candidates; p1; p1 = p1->next)
+            for (i = 0; i < nyes; ++i)
+                if (yes[i] == p1->value) {
+                    found(s, p, p1->value);
+                    break;
+                }
+    free(yes);
+    free(no);
+    return ret;
+}
+
+/* Build a target multiple times (touching different files in between) to
+ * determine which of candidates it depends on, which are left in p->found.
+ * Note that the initial build is discarded unless it fails because it tells
+ * us nothing about dependencies. The working directory is expected to be
+ * clean.
+ */
+static void examine_builds(scrutineer_t *s, list_t *p, list_t *candidates) {
+    struct timespec start;
+    time_t now, old, before;
+    list_t *p1, *ordered, *inside = NULL, *outside = NULL;
+    strings_t sampled = { NULL, 0 };
+    size_t i;
+    int ret, *errors;
+
+    /* Leave what there's no time for unassessed. */
+    if (out_of_time(s))
+        return;
+
+    p->assessed = 1;
+    p->estimated = 0;
+    p->phony = 0;
+    p->dirty = 0;
+    p->failed = 0;
+    free(p->found.items);
+    p->found.items = NULL;
+    p->found.count = 0;
+
+    /* Initial build to set the stage. Remember a time from before it
+     * started so we can stamp components as older than anything it
+     * produces, including intermediate files.
+     */
+    assert(p->value);
+    before = time(NULL) - 1;
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = build(s, p->value);
+    if (ret == 0)
+        profile_build(s, p->value, seconds_since(&start));
+    if (ret == RUN_TIMED_OUT && out_of_time(s)) {
+        p->assessed = 0;
+        if (run(s->clean))
+            DIE("Error: Clean failed.\n");
+        return;
+    }
+    if (ret) {
+        if (ret == RUN_TIMED_OUT)
+            warn("Gave up on building %s from scratch.\n", p->value);
+        else
+            warn("Failed to build %s from scratch. Broken %s recipe?\n",
+                p->value, p->value);
+        p->failed = 1;
+        return;
+    }
+
+    if (!exists(p->value)) {
+        warn("%s appears to be PHONY! I can't assess this.\n", p->value);
+        p->phony = 1;
+        return;
+    }
+
+    /* Touch every component so we have a known starting point. The target
+     * is later stamped with a time from a second after the build finished,
+     * as files it produced may carry sub-second timestamps.
+     */
+    now = get_now(time(NULL));
+    errors = touch_list(candidates, before);
+    for (p1 = candidates, i = 0; p1; p1 = p1->next, ++i) {
+        if (errors[i] == ENOENT)
+            warn("component %s now doesn't exist, although cleaning does "
+                "not seem to delete it. Destructive recipe somewhere in your "
+                "Makefile?\n", p1->value);
+        else if (errors[i]) {
+            free(errors);
+            DIE("Could not update timestamp for %s.\n", p1->value);
+        }
+    }
+    free(errors);
+
+    /* Touch the target to make sure it is considered up to date with
+     * respect to all the potential dependencies. Note, this is here because
+     * the target may not actually be in the user-provided list of files.
+     */
+    assert(exists(p->value));
+    if (touch(p->value, now)) {
+        warn("Could not update timestamp for %s (cannot determine "
+            "dependencies).\n", p->value);
+        p->failed = 1;
+        return;
+    }
+
+    /* Build once more without touching anything. A target that gets rebuilt
+     * here is always out of date, so every component would look like one of
+     * its dependencies. There is no point probing it. We wait for the clock
+     * to pass now first, otherwise a rebuild within the same second would go
+     * unnoticed.
+     */
+    if (s->strategy & SCRUTINEER_CONTENT)
+        note_target(s, p->value);
+    (void)get_now(now);
+    ret = build(s, p->value);
+    if (ret == RUN_TIMED_OUT) {
+        s->timed_out = 1;
+        finish(s, p);
+        return;
+    }
+    if (ret)
+        DIE("Error: Failed to rebuild %s without touching anything.\n",
+            p->value);
+    if (!exists(p->value))
+        DIE("Error: %s, that was NOT a phony target, was removed when "
+            "rebuilding without touching anything. Broken recipe for %s?\n",
+            p->value, p->value);
+    if (get_mtime(p->value) != now || ((s->strategy & SCRUTINEER_CONTENT) &&
+            changed_anyway(s, p->value))) {
+        warn("%s is rebuilt even when nothing has changed. Skipping it.\n",
+            p->value);
+        p->dirty = 1;
+        if (run(s->clean))
+            DIE("Error: Clean failed.\n");
+        return;
+    }
+
+    old = now; /* The timestamp we've marked each file with. */
+
+    /* Probe the likeliest dependencies first, so that they are the ones
+     * found if we run out of time.
+     */
+    ordered = order_candidates(s, p, candidates);
+    candidates = ordered;
+
+    /* Settle for an estimate if that's all we were asked for. */
+    if (s->estimate) {
+        estimate(s, p, candidates, before, &old);
+        free_nodes(ordered);
+        finish(s, p);
+        return;
+    }
+
+    /* If we can tell from the rules alone, there is nothing to probe. */
+    if ((s->strategy & SCRUTINEER_EVALUATE) && s->backend->graph &&
+            !evaluate(s, p, candidates, &old)) {
+        free_nodes(ordered);
+        finish(s, p);
+        return;
+    }
+
+    /* Don't waste builds on files the rules say can't matter. */
+    if ((s->strategy & SCRUTINEER_PREFILTER) && s->backend->reachable) {
+        if (prefilter(s, p, candidates, &inside, &outside, &sampled))
+            warn("Can't tell from its rules what %s could depend on. "
+                "Probing every candidate.\n", p->value);
+        else
+            candidates = inside;
+    }
+
+    if ((s->strategy & SCRUTINEER_DEPFILES) || s->backend->known) {
+        /* Dependencies the compiler or build system told us about are
+         * probably real, so confirm them one by one. The rest are probably
+         * not, which group testing can establish in far fewer builds.
+         */
+        const char **known, **rest = NULL, **unconfirmed = NULL;
+        size_t nknown, nrest = 0, nunconfirmed = 0;
+        depfiles_t d = { NULL, 0 };
+
+        if (s->strategy & SCRUTINEER_DEPFILES)
+            find_depfiles(".", before, &d);
+        if (s->backend->known)
+            s->backend->known(s->build, s->target_arg, p->value, &d);
+        known = prior(&d, p->value, &nknown);
+        for (p1 = candidates; p1; p1 = p1->next) {
+            const char *f = normalise(p1->value);
+
+            if (bsearch(&f, known, nknown, sizeof(char*), compare_strings)) {
+                int rebuilt = probe(s, p->value, &p1->value, 1, &old);
+
+                if (rebuilt > 0)
+                    found(s, p, p1->value);
+                else if (rebuilt == 0) {
+                    unconfirmed = (const char**)realloc(unconfirmed,
+                        sizeof(char*) * (nunconfirmed + 1));
+                    unconfirmed[nunconfirmed++] = p1->value;
+                }
+            } else {
+                rest = (const char**)realloc(rest,
+                    sizeof(char*) * (nrest + 1));
+                rest[nrest++] = p1->value;
+            }
+        }
+        batch_test(s, p, rest, nrest, &old);
+
+        for (i = 0; i < nunconfirmed; ++i)
+            warn("%s says %s depends on %s but touching it does not rebuild "
+                "%s. Missing prerequisite?\n",
+                (s->strategy & SCRUTINEER_DEPFILES) ? "a depfile" :
+                    s->backend->name,
+                p->value, unconfirmed[i], p->value);
+        free(unconfirmed);
+        free(rest);
+        free(known);
+        free_depfiles(&d);
+    } else {
+        for (p1 = candidates; p1; p1 = p1->next)
+            if (probe(s, p->value, &p1->value, 1, &old) > 0)
+                found(s, p, p1->value);
+    }
+
+    /* If the sample turned up something the rules missed, they can't be
+     * trusted for anything else either.
+     */
+    for (i = 0; !s->timed_out && i < sampled.count; ++i)
+        if (contains(&p->found, sampled.items[i])) {
+            const char **rest = NULL;
+            size_t nrest = 0;
+
+            warn("%s depends on %s, which its rules do not lead to. "
+                "Probing every candidate.\n", p->value, sampled.items[i]);
+            for (p1 = outside; p1; p1 = p1->next) {
+                rest = (const char**)realloc(rest,
+                    sizeof(char*) * (nrest + 1));
+                if (!rest)
+                    DIE("Out of memory.\n");
+                rest[nrest++] = p1->value;
+            }
+            batch_test(s, p, rest, nrest, &old);
+            free(rest);
+            break;
+        }
+    free(sampled.items);
+    free_nodes(inside);
+    free_nodes(outside);
+    free_nodes(ordered);
+
+    finish(s, p);
+}
+
+/* Find which of candidates p depends on, as examine_builds, and if asked
+ * to, report every other file its builds wrote.
+ */
+void examine(scrutineer_t *s, list_t *p, list_t *candidates) {
+    size_t i;
+
+    examine_builds(s, p, candidates);
+    /* Only a full set of dependencies says what to expect next time. */
+    if (candidates == s->dependencies && p->assessed && !p->failed &&
+            !p->phony && !p->dirty && !p->estimated)
+        profile_deps(s, p->value, p->found.count);
+    qsort(s->wrote.items, s->wrote.count, sizeof(char*), compare_strings);
+    for (i = 0; i < s->wrote.count; ++i) {
+        if (strcmp(s->wrote.items[i], normalise(p->value)))
+            progress(s, SCRUTINEER_WROTE, p->value, s->wrote.items[i]);
+        free((char*)s->wrote.items[i]);
+    }
+    free(s->wrote.items);
+    s->wrote.items = NULL;
+    s->wrote.count = 0;
+}
+
+/* Assess a target against all the candidates, telling the progress callback.
+ */
+void assess(scrutineer_t *s, list_t *p) {
+    progress(s, SCRUTINEER_TARGET_START, p->value, NULL);
+    examine(s, p, s->dependencies);
+    journal_target(&s->journal, p);
+    progress(s, SCRUTINEER_TARGET_DONE, p->value, NULL);
+}
+
+/* Fill in any settings that were left to default and do the initial clean.
+ * This only happens once per context.
+ */
+void prepare(scrutineer_t *s) {
+    if (s->prepared)
+        return;
+
+    /* Pick a build system if we weren't told which. */
+    if (!s->backend)
+        s->backend = find_backend(exists("build.ninja") &&
+            !exists("Makefile") && !exists("makefile") &&
+            !exists("GNUmakefile") ? "ninja" : "make");
+
+    if (!s->clean)
+        s->clean = split(s->backend->default_clean);
+    if (!s->build)
+        s->build = with_target(split(s->backend->default_build),
+            &s->target_arg);
+
+    if (!s->makefiles.count) {
+        static const char *const defaults[] = {
+            "Makefile", "makefile", "GNUmakefile", "build.ninja",
+        };
+        size_t i;
+
+        for (i = 0; i < sizeof(defaults) / sizeof(defaults[0]); ++i)
+            if (exists(defaults[i]))
+                append(&s->makefiles, strdup(defaults[i]));
+    }
+
+    save_times(s);
+
+    /* Initial clean. */
+    if (run(s->clean))
+        DIE("Error: Clean failed.\n");
+    s->prepared = 1;
+}
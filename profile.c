@@ -0,0 +1,186 @@
+/* A profile of what building each target costs, kept between runs so that
+ * later ones can plan around it.
+ *
+ * The profile is a text file of tab separated records, one per target:
+ *
+ *     <seconds> <builds> <dependencies> <target>
+ *
+ * seconds is the average time a build of the target from scratch has taken,
+ * over the last few builds, or -1 if we have never timed one. dependencies is
+ * how many we found it to have when last probed, or -1. The file is written
+ * afresh, by renaming a new one over it, when a run finishes.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "internal.h"
+
+/* The first line of a profile. */
+#define PROFILE_HEADER "# scrutineer profile 1"
+
+/* How many builds to average over. Older ones count for less and less, so
+ * a target that has grown slower is soon seen as such.
+ */
+#define WINDOW 8
+
+static int compare_costs(const void *a, const void *b) {
+    return strcmp(((const cost_t*)a)->target, ((const cost_t*)b)->target);
+}
+
+const cost_t *profile_lookup(const scrutineer_t *s, const char *target) {
+    const cost_t key = { (char*)target, 0, 0, 0 };
+
+    return (const cost_t*)bsearch(&key, s->profile.costs, s->profile.count,
+        sizeof(cost_t), compare_costs);
+}
+
+/* The record for target, adding an empty one if there isn't one yet. */
+static cost_t *cost(profile_t *pr, const char *target) {
+    size_t lo = 0, hi = pr->count;
+    cost_t *c;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = strcmp(pr->costs[mid].target, target);
+
+        if (cmp == 0)
+            return &pr->costs[mid];
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    pr->costs = (cost_t*)realloc(pr->costs, sizeof(cost_t) * (pr->count + 1));
+    if (!pr->costs)
+        DIE("Out of memory.\n");
+    c = &pr->costs[lo];
+    memmove(c + 1, c, sizeof(cost_t) * (pr->count - lo));
+    ++pr->count;
+    c->target = strdup(target);
+    if (!c->target)
+        DIE("Out of memory.\n");
+    c->seconds = -1;
+    c->builds = 0;
+    c->deps = -1;
+    return c;
+}
+
+/* Read the profile at s->profile_path, if there is one yet. */
+void read_profile(scrutineer_t *s) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    FILE *f;
+
+    free_profile(&s->profile);
+    f = fopen(s->profile_path, "r");
+    if (!f)
+        return;
+    if (getline(&line, &cap, f) < 0 ||
+            strncmp(line, PROFILE_HEADER, strlen(PROFILE_HEADER))) {
+        free(line);
+        fclose(f);
+        DIE("%s is not a profile written by scrutineer.\n", s->profile_path);
+    }
+    while ((len = getline(&line, &cap, f)) >= 0) {
+        double seconds;
+        unsigned int builds;
+        long deps;
+        int skip = 0;
+        cost_t *c;
+
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (sscanf(line, "%lf\t%u\t%ld\t%n", &seconds, &builds, &deps,
+                &skip) != 3 || skip == 0 || line[skip] == '\0')
+            continue;
+        c = cost(&s->profile, line + skip);
+        c->seconds = seconds;
+        c->builds = builds;
+        c->deps = deps;
+    }
+    free(line);
+    fclose(f);
+}
+
+/* Write the profile back, if we were asked to keep one. Failing to is no
+ * reason to fail the run it describes.
+ */
+void write_profile(scrutineer_t *s) {
+    char *tmp;
+    FILE *f;
+    size_t i;
+    int ok;
+
+    if (!s->profile_path)
+        return;
+    tmp = (char*)malloc(strlen(s->profile_path) + 5);
+    if (!tmp)
+        DIE("Out of memory.\n");
+    sprintf(tmp, "%s.new", s->profile_path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        warn("Failed to open %s for writing.\n", tmp);
+        free(tmp);
+        return;
+    }
+    fprintf(f, "%s\n", PROFILE_HEADER);
+    for (i = 0; i < s->profile.count; ++i) {
+        const cost_t *c = &s->profile.costs[i];
+
+        fprintf(f, "%.3f\t%u\t%ld\t%s\n", c->seconds, c->builds, c->deps,
+            c->target);
+    }
+    ok = !ferror(f);
+    if (fclose(f))
+        ok = 0;
+    if (!ok || rename(tmp, s->profile_path)) {
+        (void)remove(tmp);
+        warn("Failed to write the profile %s.\n", s->profile_path);
+    }
+    free(tmp);
+}
+
+/* Note that building target from scratch took seconds. */
+void profile_build(scrutineer_t *s, const char *target, double seconds) {
+    cost_t *c;
+
+    if (!s->profile_path)
+        return;
+    c = cost(&s->profile, target);
+    if (c->builds < WINDOW)
+        ++c->builds;
+    if (c->seconds < 0)
+        c->seconds = seconds;
+    else
+        c->seconds += (seconds - c->seconds) / c->builds;
+}
+
+/* Note that probing target found deps dependencies. */
+void profile_deps(scrutineer_t *s, const char *target, size_t deps) {
+    if (s->profile_path)
+        cost(&s->profile, target)->deps = (long)deps;
+}
+
+/* Seconds since start, which came from CLOCK_MONOTONIC. */
+double seconds_since(const struct timespec *start) {
+    struct timespec now;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) +
+        (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void free_profile(profile_t *pr) {
+    size_t i;
+
+    for (i = 0; i < pr->count; ++i)
+        free(pr->costs[i].target);
+    free(pr->costs);
+    pr->costs = NULL;
+    pr->count = 0;
+}
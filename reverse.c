@@ -0,0 +1,140 @@
+/* Finding which targets depend on the candidates, rather than which
+ * candidates each target depends on. Every target is checked by the same
+ * build, so this costs a few builds however many targets there are.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "internal.h"
+
+/* Build everything we're checking in one go, with the targets named or, if
+ * argv has none, whatever the build does by default.
+ */
+static void build_all(scrutineer_t *s, char **argv, const char *what) {
+    int ret = run_in(NULL, argv, s->timeout, &s->output);
+
+    if (ret == RUN_TIMED_OUT)
+        DIE("Error: Building %s timed out.\n", what);
+    if (ret) {
+        show_output(s, what);
+        DIE("Error: Failed to build %s.\n", what);
+    }
+}
+
+/* Add every file the build system knows how to make, other than the
+ * candidates, that the default build produced.
+ */
+static void find_targets(scrutineer_t *s) {
+    strings_t all = { NULL, 0 };
+    size_t i;
+
+    if (!s->backend->targets || s->backend->targets(s->build, s->target_arg,
+            &all))
+        DIE("%s can't list its targets, so they have to be given.\n",
+            s->backend->name);
+    for (i = 0; i < all.count; ++i) {
+        const char *t = all.items[i];
+        const list_t *p;
+
+        for (p = s->dependencies; p; p = p->next)
+            if (!strcmp(normalise(p->value), t))
+                break;
+        if (!p && exists(t)) {
+            list_t *temp = (list_t*)calloc(1, sizeof(list_t));
+
+            if (!temp || !(temp->value = strdup(t)))
+                DIE("Out of memory.\n");
+            temp->next = s->targets;
+            s->targets = temp;
+        }
+        free((char*)t);
+    }
+    free(all.items);
+}
+
+/* Touch every candidate there is with timestamp. */
+static void touch_candidates(scrutineer_t *s, time_t timestamp) {
+    int *errors = touch_list(s->dependencies, timestamp);
+    const list_t *p;
+    size_t i;
+
+    for (p = s->dependencies, i = 0; p; p = p->next, ++i)
+        if (errors[i] && errors[i] != ENOENT) {
+            free(errors);
+            DIE("Could not update timestamp for %s.\n", p->value);
+        }
+    free(errors);
+}
+
+/* Touch every candidate at once and see which targets that rebuilds. With no
+ * targets, check everything the default build produces.
+ */
+void reverse(scrutineer_t *s) {
+    const char **names = NULL;
+    size_t n = 0;
+    char **argv;
+    time_t before, now, then;
+    list_t *p;
+    int all = !s->targets;
+
+    for (p = s->targets; p; p = p->next) {
+        names = (const char**)realloc(names, sizeof(char*) * (n + 1));
+        if (!names)
+            DIE("Out of memory.\n");
+        names[n++] = p->value;
+    }
+    argv = command(s->build, s->target_arg, names, (unsigned int)n);
+    free(names);
+
+    /* Build everything from scratch, as for a single target. */
+    before = time(NULL) - 1;
+    build_all(s, argv, "the targets");
+    if (all)
+        find_targets(s);
+
+    now = get_now(time(NULL));
+    touch_candidates(s, before);
+    for (p = s->targets; p; p = p->next) {
+        progress(s, SCRUTINEER_TARGET_START, p->value, NULL);
+        p->assessed = 1;
+        p->affected = 0;
+        if (!exists(p->value)) {
+            warn("%s appears to be PHONY! I can't assess this.\n", p->value);
+            p->phony = 1;
+        } else if (touch(p->value, now)) {
+            warn("Could not update timestamp for %s.\n", p->value);
+            p->failed = 1;
+        }
+    }
+
+    /* Anything rebuilt without our touching anything is no use to us. */
+    (void)get_now(now);
+    build_all(s, argv, "the targets again");
+    for (p = s->targets; p; p = p->next)
+        if (!p->phony && !p->failed && get_mtime(p->value) != now) {
+            warn("%s is rebuilt even when nothing has changed. Skipping "
+                "it.\n", p->value);
+            p->dirty = 1;
+        }
+
+    /* The real question. */
+    then = get_now(now);
+    touch_candidates(s, then);
+    build_all(s, argv, "the targets after touching the candidates");
+    for (p = s->targets; p; p = p->next) {
+        if (!p->phony && !p->failed && !p->dirty &&
+                get_mtime(p->value) != now) {
+            p->affected = 1;
+            progress(s, SCRUTINEER_AFFECTED, p->value, NULL);
+        }
+        progress(s, SCRUTINEER_TARGET_DONE, p->value, NULL);
+    }
+    free(argv);
+
+    if (run(s->clean))
+        DIE("Error: Clean failed.\n");
+}
@@ -0,0 +1,401 @@
+/* Running commands for libscrutineer.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "internal.h"
+
+/* How long a command that ran out of time gets to tidy up after SIGTERM
+ * before the rest of its process group is killed, in milliseconds.
+ */
+#define GRACE 1000
+
+/* The process groups of the commands running with a timeout, which signals
+ * meant for us don't reach, so that we can pass those on. A free slot is 0.
+ * Past MAX_GROUPS at once, further commands go untracked.
+ */
+#define MAX_GROUPS 256
+static atomic_int groups[MAX_GROUPS];
+
+static atomic_int *track(pid_t group) {
+    size_t i;
+
+    for (i = 0; i < MAX_GROUPS; ++i) {
+        int free = 0;
+
+        if (atomic_compare_exchange_strong(&groups[i], &free, (int)group))
+            return &groups[i];
+    }
+    return NULL;
+}
+
+/* Stop tracking a group. This has to happen before its leader is reaped, as
+ * after that its ID may be reused.
+ */
+static void untrack(atomic_int *slot) {
+    if (slot)
+        atomic_store(slot, 0);
+}
+
+void scrutineer_signal(int sig) {
+    size_t i;
+
+    for (i = 0; i < MAX_GROUPS; ++i) {
+        int group = atomic_load(&groups[i]);
+
+        if (group > 0)
+            (void)kill(-(pid_t)group, sig);
+    }
+}
+
+/* Read whatever is waiting on fd straight into the ring, overwriting the
+ * oldest output once it is full. fd must be non-blocking. Returns 0 at end of
+ * file.
+ */
+static int drain(int fd, ring_t *ring) {
+    for (;;) {
+        size_t at = ring->written % RING_SIZE;
+        struct iovec v[2];
+        ssize_t n;
+
+        v[0].iov_base = ring->data + at;
+        v[0].iov_len = RING_SIZE - at;
+        v[1].iov_base = ring->data;
+        v[1].iov_len = at;
+        n = readv(fd, v, at ? 2 : 1);
+        if (n > 0)
+            ring->written += (size_t)n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else
+            return n != 0;
+    }
+}
+
+/* Wait up to ms milliseconds, or forever if ms is negative, for proc to exit,
+ * leaving it to be reaped. Meanwhile anything written to out goes into ring,
+ * unless out is -1. Returns 1 if proc exited.
+ */
+static int exited(pid_t proc, long ms, int out, ring_t *ring) {
+    struct timespec start, now;
+    long waited, nap = 1;
+    int fd = -1, done = 0;
+
+#ifdef SYS_pidfd_open
+    /* A pidfd becomes readable when the process exits, which saves us
+     * polling for it.
+     */
+    fd = (int)syscall(SYS_pidfd_open, proc, 0);
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        struct pollfd p[2];
+        nfds_t n = 0;
+        siginfo_t info;
+        int wait = -1;
+
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_PID, proc, &info, WEXITED | WNOHANG | WNOWAIT)) {
+            if (errno == EINTR)
+                continue;
+            done = 1; /* Nothing left to wait for. */
+            break;
+        }
+        if (info.si_pid == proc) {
+            done = 1;
+            break;
+        }
+
+        if (ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            waited = (long)(now.tv_sec - start.tv_sec) * 1000 +
+                (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (waited >= ms)
+                break;
+            wait = ms - waited > INT_MAX ? INT_MAX : (int)(ms - waited);
+        }
+        if (fd >= 0) {
+            p[n].fd = fd;
+            p[n++].events = POLLIN;
+        } else if (wait < 0 || wait > nap) {
+            wait = (int)nap;
+            if (nap < 100)
+                nap *= 2;
+        }
+        if (out >= 0) {
+            p[n].fd = out;
+            p[n++].events = POLLIN;
+        }
+        if (poll(p, n, wait) > 0 && out >= 0 && p[n - 1].revents &&
+                !drain(out, ring))
+            out = -1; /* Everything that could write to it has gone. */
+    }
+    if (out >= 0)
+        (void)drain(out, ring);
+    if (fd >= 0)
+        close(fd);
+    return done;
+}
+
+/* Run the given command in the given directory and return the exit code. If
+ * dir is NULL the command runs in the current directory. If it is still
+ * running after timeout seconds it is killed, along with everything it
+ * started, and RUN_TIMED_OUT is returned. A timeout of 0 means no limit. The
+ * end of what the command writes to stdout and stderr is kept in output, if
+ * it isn't NULL.
+ */
+int run_in(const char *dir, char *const argv[], unsigned int timeout,
+        ring_t *output) {
+    return run_within(0, dir, argv, timeout, output);
+}
+
+/* As run_in, but if holder isn't 0 the command runs in the namespaces of that
+ * sandbox holder, where dir is to be found.
+ */
+int run_within(pid_t holder, const char *dir, char *const argv[],
+        unsigned int timeout, ring_t *output) {
+    int fds[2] = { -1, -1 };
+    pid_t proc;
+
+#ifndef NDEBUG
+    /* Check the arguments we're about to exec are NULL-terminated. It's
+     * debatable how useful this check is as it should just crash out with a
+     * segfault, which is what execvp would have done anyway. At least we can
+     * ensure execvp doesn't even begin execution.
+     */
+    int i = 0;
+    while (argv[i++]);
+#endif
+
+    if (output) {
+        output->written = 0;
+        if (pipe2(fds, O_CLOEXEC) ||
+                fcntl(fds[0], F_SETFL, O_NONBLOCK)) {
+            if (fds[0] >= 0) {
+                close(fds[0]);
+                close(fds[1]);
+            }
+            fds[0] = fds[1] = -1;
+            output = NULL;
+        }
+    }
+
+    /* Without flushing stdout/stderr before forking, both parent and child
+     * process inherit anything in the buffers and eventually end up flushing
+     * (two copies of) it.
+     */
+    fflush(stdout);
+    fflush(stderr);
+
+    proc = fork();
+    if (proc == 0) {
+        /* Child process. */
+
+        /* Start a process group of our own, so that if we run out of time
+         * everything we started can be killed together.
+         */
+        if (timeout)
+            (void)setpgid(0, 0);
+
+        /* Supress our output, or send it to the parent. */
+        if (output) {
+            if (dup2(fds[1], STDOUT_FILENO) < 0 ||
+                    dup2(fds[1], STDERR_FILENO) < 0)
+                exit(1);
+        } else {
+            stdout = freopen("/dev/null", "w", stdout);
+            assert(stdout);
+            stderr = freopen("/dev/null", "w", stderr);
+            assert(stderr);
+        }
+        stdin = freopen("/dev/null", "r", stdin);
+        assert(stdin);
+
+        if (holder && enter_sandbox(holder))
+            exit(1);
+        if (dir && chdir(dir))
+            exit(1);
+
+        (void)execvp(argv[0], argv);
+
+        /* If we reach this point execvp failed. */
+        exit(1);
+    } else if (proc > 0) {
+        /* Parent process. */
+        int status;
+
+        if (output)
+            close(fds[1]);
+
+        if (timeout) {
+            atomic_int *slot = track(proc);
+
+            /* Also set the group here, in case we get to killing it before
+             * the child has.
+             */
+            (void)setpgid(proc, proc);
+            if (!exited(proc, timeout * 1000L, fds[0], output)) {
+                (void)kill(-proc, SIGTERM);
+                (void)exited(proc, GRACE, fds[0], output);
+                /* proc is not reaped yet, so the group is still ours. */
+                (void)kill(-proc, SIGKILL);
+                untrack(slot);
+                while (waitpid(proc, &status, 0) < 0 && errno == EINTR);
+                if (output) {
+                    (void)drain(fds[0], output);
+                    close(fds[0]);
+                }
+                return RUN_TIMED_OUT;
+            }
+            untrack(slot);
+        } else if (output)
+            (void)exited(proc, -1, fds[0], output);
+        if (output)
+            close(fds[0]);
+
+        switch (waitpid(proc, &status, 0)) {
+            case -1:
+                /* Terminated by signal to me. Fall through. */
+            case 0: {
+                /* Status unavailable. */
+                return errno;
+                break;
+            } default: {
+                /* wait returned proc; expected. */
+                return status;
+                break;
+            }
+        }
+    } else {
+        /* Fork failed. */
+        int err = errno;
+
+        if (output) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+        return err;
+    }
+}
+
+/* Copy what's in the ring out in order, as a string. The caller owns the
+ * result.
+ */
+char *ring_text(const ring_t *ring) {
+    size_t len = ring->written < RING_SIZE ? ring->written : RING_SIZE;
+    size_t at = ring->written % RING_SIZE;
+    char *text = (char*)malloc(len + 1);
+
+    if (!text)
+        DIE("Out of memory.\n");
+    if (ring->written <= RING_SIZE)
+        memcpy(text, ring->data, len);
+    else {
+        memcpy(text, ring->data + at, RING_SIZE - at);
+        memcpy(text + RING_SIZE - at, ring->data, at);
+    }
+    text[len] = '\0';
+    return text;
+}
+
+/* Run the given command and return the exit code. */
+int run(char *const argv[]) {
+    return run_in(NULL, argv, 0, NULL);
+}
+
+/* Run the given command and return what it wrote to stdout, or NULL if it
+ * failed. The caller owns the result.
+ */
+char *run_output(char *const argv[]) {
+    int fds[2], status;
+    pid_t proc;
+    char *out = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t r;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    if (pipe(fds))
+        return NULL;
+    proc = fork();
+    if (proc == 0) {
+        /* Child process. */
+        close(fds[0]);
+        if (dup2(fds[1], STDOUT_FILENO) < 0)
+            exit(1);
+        close(fds[1]);
+        stderr = freopen("/dev/null", "w", stderr);
+        assert(stderr);
+        stdin = freopen("/dev/null", "r", stdin);
+        assert(stdin);
+
+        (void)execvp(argv[0], argv);
+        exit(1);
+    } else if (proc < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+
+    /* Parent process. */
+    close(fds[1]);
+    for (;;) {
+        if (cap - len < BUFSIZ) {
+            cap = cap ? cap * 2 : BUFSIZ * 4;
+            out = (char*)realloc(out, cap);
+            if (!out)
+                DIE("Out of memory.\n");
+        }
+        r = read(fds[0], out + len, cap - len - 1);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        len += r;
+    }
+    close(fds[0]);
+    out[len] = '\0';
+
+    if (waitpid(proc, &status, 0) != proc || status) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/* Build a command line of tool followed by the given arguments. The caller
+ * owns the array but not the strings in it.
+ */
+char **command(char *const *tool, unsigned int tool_len,
+        const char *const *args, unsigned int nargs) {
+    char **argv;
+    unsigned int i;
+
+    argv = (char**)malloc(sizeof(char*) * (tool_len + nargs + 1));
+    if (!argv)
+        DIE("Out of memory.\n");
+    for (i = 0; i < tool_len; ++i)
+        argv[i] = tool[i];
+    for (i = 0; i < nargs; ++i)
+        argv[tool_len + i] = (char*)args[i];
+    argv[tool_len + nargs] = NULL;
+    return argv;
+}
+
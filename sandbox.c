@@ -0,0 +1,289 @@
+/* Sandboxes to build in apart from the working directory.
+ *
+ * Where the kernel lets us, a sandbox is an overlay of the working directory
+ * in a user and mount namespace of its own, with the build's writes going to
+ * a tmpfs. Setting one up costs the same however big the tree is, and
+ * nothing written in it can be seen from the working directory or from other
+ * sandboxes. Without kernel overlays we try fuse-overlayfs, and failing that
+ * we copy the working directory as we always have.
+ *
+ * A namespace lasts as long as something is in it, so each overlaid sandbox
+ * has a holder process that does nothing but wait to be told to go. Builds
+ * join its namespaces, and we read what they left through its root in /proc.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "internal.h"
+
+/* What the holder tells us once the sandbox is ready. */
+#define KERNEL_OVERLAY 'k'
+#define FUSE_OVERLAY 'f'
+
+static int write_file(const char *path, const char *text) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC), ret = -1;
+
+    if (fd < 0)
+        return -1;
+    if (write(fd, text, strlen(text)) == (ssize_t)strlen(text))
+        ret = 0;
+    if (close(fd))
+        ret = -1;
+    return ret;
+}
+
+/* Make ourselves root of a new user namespace, being the same user and group
+ * we were outside it, with a mount namespace of our own.
+ */
+static int unshare_ids(void) {
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+    char map[64];
+
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNS))
+        return -1;
+    sprintf(map, "%u %u 1", (unsigned int)uid, (unsigned int)uid);
+    if (write_file("/proc/self/uid_map", map))
+        return -1;
+    /* We have to give up setgroups before we may map a group. */
+    if (write_file("/proc/self/setgroups", "deny") && errno != ENOENT)
+        return -1;
+    sprintf(map, "%u %u 1", (unsigned int)gid, (unsigned int)gid);
+    if (write_file("/proc/self/gid_map", map))
+        return -1;
+    /* Keep our mounts from reaching the namespace we came from. */
+    return mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL);
+}
+
+/* Close every descriptor above stderr except a and b. Left open, a holder
+ * would keep them so for as long as it lasts, among them the pipes other
+ * holders wait on.
+ */
+static void close_others(int a, int b) {
+    int lo = a < b ? a : b, hi = a < b ? b : a, fd;
+#ifdef SYS_close_range
+    if ((lo == 3 || !syscall(SYS_close_range, 3, lo - 1, 0)) &&
+            (hi == lo + 1 || !syscall(SYS_close_range, lo + 1, hi - 1, 0)) &&
+            !syscall(SYS_close_range, hi + 1, ~0U, 0))
+        return;
+#endif
+    for (fd = 3; fd < sysconf(_SC_OPEN_MAX); ++fd)
+        if (fd != lo && fd != hi)
+            (void)close(fd);
+}
+
+/* The holder's side. Mount the sandbox, say how on ready and then wait for
+ * hold to be closed, when the namespace and everything mounted in it goes.
+ */
+static void hold(const sandbox_t *sb, mode_t mode, const char *options,
+        char *fuse, int ready, int hold) {
+    char *upper = join(sb->dir, "upper"), *work = join(sb->dir, "work");
+    char kind, c;
+    ssize_t r;
+
+    close_others(ready, hold);
+    /* Interrupting us is our parent's business. */
+    (void)signal(SIGINT, SIG_IGN);
+    (void)signal(SIGTERM, SIG_DFL);
+    if (unshare_ids() || mount("tmpfs", sb->dir, "tmpfs", 0, "mode=0700") ||
+            mkdir(upper, mode) || mkdir(work, 0700) ||
+            mkdir(sb->tree, mode))
+        _exit(1);
+
+    if (!mount("overlay", sb->tree, "overlay", 0, options))
+        kind = KERNEL_OVERLAY;
+    else {
+        char *argv[] = { fuse, "-o", (char*)options, sb->tree, NULL };
+
+        if (!fuse || run(argv))
+            _exit(1);
+        kind = FUSE_OVERLAY;
+    }
+    if (write(ready, &kind, 1) != 1)
+        _exit(1);
+
+    do
+        r = read(hold, &c, 1);
+    while (r < 0 && errno == EINTR);
+    /* A fuse daemon only leaves once its file system is unmounted. */
+    (void)umount2(sb->tree, MNT_DETACH);
+    _exit(0);
+}
+
+/* Try to set up sb->dir as an overlaid sandbox. Returns 0 on success or -1 if
+ * we can't here.
+ */
+static int overlay(sandbox_t *sb) {
+    char *lower, *options, *fuse, kind = 0;
+    int ready[2], held[2];
+    struct stat st;
+    size_t len;
+    pid_t pid;
+
+    lower = getcwd(NULL, 0);
+    if (!lower)
+        return -1;
+    /* These would be read as separators in the mount options. */
+    if (strpbrk(lower, ",:\\") || strpbrk(sb->dir, ",:\\") ||
+            stat(lower, &st)) {
+        free(lower);
+        return -1;
+    }
+    len = strlen(lower) + 2 * strlen(sb->dir) + 64;
+    options = (char*)malloc(len);
+    if (!options)
+        DIE("Out of memory.\n");
+    snprintf(options, len, "lowerdir=%s,upperdir=%s/upper,workdir=%s/work",
+        lower, sb->dir, sb->dir);
+    free(lower);
+    fuse = find_program("fuse-overlayfs");
+
+    if (mkdir(sb->dir, 0700)) {
+        free(options);
+        free(fuse);
+        return -1;
+    }
+    if (pipe2(ready, O_CLOEXEC)) {
+        free(options);
+        free(fuse);
+        (void)rmdir(sb->dir);
+        return -1;
+    }
+    if (pipe2(held, O_CLOEXEC)) {
+        close(ready[0]);
+        close(ready[1]);
+        free(options);
+        free(fuse);
+        (void)rmdir(sb->dir);
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        close(ready[0]);
+        close(held[1]);
+        hold(sb, st.st_mode & 07777, options, fuse, ready[1], held[0]);
+    }
+    free(options);
+    free(fuse);
+    close(ready[1]);
+    close(held[0]);
+
+    /* We hear nothing if it failed. */
+    while (pid > 0 && read(ready[0], &kind, 1) < 0 && errno == EINTR);
+    close(ready[0]);
+    if (pid < 0 || (kind != KERNEL_OVERLAY && kind != FUSE_OVERLAY)) {
+        close(held[1]);
+        if (pid > 0)
+            while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+        (void)rmdir(sb->dir);
+        return -1;
+    }
+
+    sb->holder = pid;
+    sb->hold = held[1];
+    sb->view = (char*)malloc(strlen(sb->tree) + 32);
+    if (!sb->view)
+        DIE("Out of memory.\n");
+    sprintf(sb->view, "/proc/%d/root%s", (int)pid, sb->tree);
+    return 0;
+}
+
+/* Set up a sandbox called name under root, holding what is in the working
+ * directory now.
+ */
+void open_sandbox(scrutineer_t *s, const char *root, const char *name,
+        sandbox_t *sb) {
+    struct stat skip;
+    char *abs;
+
+    memset(sb, 0, sizeof(*sb));
+    sb->hold = -1;
+    /* Builds join the holder's namespaces at its root, not our working
+     * directory, so overlays need absolute paths.
+     */
+    abs = realpath(root, NULL);
+    if (!abs)
+        DIE("Failed to find %s.\n", root);
+    sb->dir = join(abs, name);
+    free(abs);
+
+    if (!s->copy_sandboxes) {
+        sb->tree = join(sb->dir, "tree");
+        if (!overlay(sb))
+            return;
+        /* It won't work any better next time. */
+        s->copy_sandboxes = 1;
+        free(sb->tree);
+    }
+
+    if (stat(root, &skip))
+        DIE("Failed to stat %s.\n", root);
+    if (copy_tree(".", sb->dir, &skip))
+        DIE("Failed to copy the working directory to %s.\n", sb->dir);
+    sb->tree = strdup(sb->dir);
+    sb->view = strdup(sb->dir);
+    if (!sb->tree || !sb->view)
+        DIE("Out of memory.\n");
+}
+
+/* Join the namespaces of a sandbox's holder. For the child of a fork, just
+ * before it runs a build.
+ */
+int enter_sandbox(pid_t holder) {
+    const char *const kinds[] = { "user", "mnt" };
+    const int types[] = { CLONE_NEWUSER, CLONE_NEWNS };
+    char path[64];
+    unsigned int i;
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        int fd, ret;
+
+        sprintf(path, "/proc/%d/ns/%s", (int)holder, kinds[i]);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        ret = setns(fd, types[i]);
+        close(fd);
+        if (ret)
+            return -1;
+    }
+    return 0;
+}
+
+/* Run a command in a sandbox, as run_in would in a directory. */
+int run_sandboxed(const sandbox_t *sb, char *const argv[],
+        unsigned int timeout, ring_t *output) {
+    return run_within(sb->holder, sb->tree, argv, timeout, output);
+}
+
+void close_sandbox(sandbox_t *sb) {
+    if (sb->holder > 0) {
+        /* Closing hold tells the holder to go, and the mounts go with it. */
+        close(sb->hold);
+        while (waitpid(sb->holder, NULL, 0) < 0 && errno == EINTR);
+        if (rmdir(sb->dir))
+            warn("failed to remove sandbox %s.\n", sb->dir);
+    } else if (remove_tree(sb->dir))
+        warn("failed to remove sandbox %s.\n", sb->dir);
+    free(sb->dir);
+    free(sb->tree);
+    free(sb->view);
+    memset(sb, 0, sizeof(*sb));
+    sb->hold = -1;
+}
@@ -0,0 +1,223 @@
+/* Cheap pictures of what is in a tree, from file metadata alone, for telling
+ * which files a build wrote.
+ *
+ * Reading every directory for every build would cost more than the builds
+ * of a small target, so the directories read last time are kept in an index
+ * and only read again when their own timestamps say they have changed. The
+ * files themselves still have to be looked at, which stat_all does in bulk.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "internal.h"
+
+/* A directory whose timestamps are unchanged has the same entries, unless
+ * it changed within the clock tick we read it in. Only trust directories
+ * last changed a whole second before we read them.
+ */
+static int unchanged(const dir_t *d, const struct stat *st) {
+    return d->ino == st->st_ino &&
+           d->mtime.tv_sec == st->st_mtim.tv_sec &&
+           d->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           d->ctime.tv_sec == st->st_ctim.tv_sec &&
+           d->ctime.tv_nsec == st->st_ctim.tv_nsec &&
+           d->ctime.tv_sec < d->read;
+}
+
+static int compare_dirs(const void *a, const void *b) {
+    return strcmp(((const dir_t*)a)->path, ((const dir_t*)b)->path);
+}
+
+static int compare_meta(const void *a, const void *b) {
+    return strcmp(((const meta_t*)a)->path, ((const meta_t*)b)->path);
+}
+
+static void free_dir(dir_t *d) {
+    size_t i;
+
+    for (i = 0; i < d->files.count; ++i)
+        free((char*)d->files.items[i]);
+    free(d->files.items);
+    for (i = 0; i < d->dirs.count; ++i)
+        free((char*)d->dirs.items[i]);
+    free(d->dirs.items);
+    free(d->path);
+}
+
+/* name within dir, where the root is "" so paths come out relative. */
+static char *within(const char *dir, const char *name) {
+    char *p = *dir ? join(dir, name) : strdup(name);
+
+    if (!p)
+        DIE("Out of memory.\n");
+    return p;
+}
+
+/* Read path afresh into d. */
+static void read_dir(dir_t *d, const char *path, const struct stat *st) {
+    DIR *dir;
+    struct dirent *e;
+
+    memset(d, 0, sizeof(*d));
+    d->path = strdup(path);
+    if (!d->path)
+        DIE("Out of memory.\n");
+    d->ino = st->st_ino;
+    d->mtime = st->st_mtim;
+    d->ctime = st->st_ctim;
+    d->read = time(NULL);
+
+    dir = opendir(*path ? path : ".");
+    if (!dir)
+        DIE("Failed to read directory %s.\n", *path ? path : ".");
+    while ((e = readdir(dir))) {
+        unsigned char type = e->d_type;
+
+        /* Version control keeps a lot in here that builds never touch. */
+        if (is_dot(e->d_name) || !strcmp(e->d_name, ".git"))
+            continue;
+        if (type == DT_UNKNOWN) {
+            struct stat est;
+            char *p = within(path, e->d_name);
+
+            type = lstat(p, &est) ? DT_UNKNOWN : S_ISDIR(est.st_mode) ?
+                DT_DIR : S_ISREG(est.st_mode) ? DT_REG :
+                S_ISLNK(est.st_mode) ? DT_LNK : DT_UNKNOWN;
+            free(p);
+        }
+        if (type == DT_DIR)
+            append(&d->dirs, within(path, e->d_name));
+        else if (type == DT_REG || type == DT_LNK)
+            append(&d->files, within(path, e->d_name));
+    }
+    closedir(dir);
+}
+
+/* Add path and everything under it to fresh, reusing what old has for
+ * directories that haven't changed and noting every file in files.
+ */
+static void refresh(const dir_index_t *old, dir_index_t *fresh,
+        const char *path, strings_t *files) {
+    dir_t key, *d, *known;
+    struct stat st;
+    size_t self, i;
+
+    if (lstat(*path ? path : ".", &st) || !S_ISDIR(st.st_mode))
+        return; /* Removed since its parent was read. */
+
+    fresh->dirs = (dir_t*)realloc(fresh->dirs,
+        sizeof(dir_t) * (fresh->count + 1));
+    if (!fresh->dirs)
+        DIE("Out of memory.\n");
+    d = &fresh->dirs[fresh->count++];
+
+    key.path = (char*)path;
+    known = (dir_t*)bsearch(&key, old->dirs, old->count, sizeof(dir_t),
+        compare_dirs);
+    if (known && unchanged(known, &st)) {
+        /* Take it over, leaving its path for later searches. */
+        *d = *known;
+        known->moved = 1;
+    } else
+        read_dir(d, path, &st);
+
+    for (i = 0; i < d->files.count; ++i)
+        append(files, d->files.items[i]);
+    /* d moves when the index grows, so go by where it is in it. */
+    self = fresh->count - 1;
+    for (i = 0; i < fresh->dirs[self].dirs.count; ++i)
+        refresh(old, fresh, fresh->dirs[self].dirs.items[i], files);
+}
+
+/* Take a picture of the files under the working directory, updating index.
+ */
+scan_t scan(dir_index_t *index) {
+    dir_index_t fresh = { NULL, 0 };
+    strings_t files = { NULL, 0 };
+    scan_t sc = { NULL, 0 };
+    size_t i, n;
+
+    refresh(index, &fresh, "", &files);
+    free_index(index);
+    qsort(fresh.dirs, fresh.count, sizeof(dir_t), compare_dirs);
+    *index = fresh;
+
+    if (files.count > 0) {
+        sc.entries = (meta_t*)calloc(files.count, sizeof(meta_t));
+        if (!sc.entries)
+            DIE("Out of memory.\n");
+    }
+    for (i = 0; i < files.count; ++i)
+        if (!(sc.entries[i].path = strdup(files.items[i])))
+            DIE("Out of memory.\n");
+    free(files.items);
+    stat_all(sc.entries, files.count);
+
+    /* Drop anything removed since we read its directory. */
+    for (i = n = 0; i < files.count; ++i)
+        if (sc.entries[i].present)
+            sc.entries[n++] = sc.entries[i];
+        else
+            free(sc.entries[i].path);
+    sc.count = n;
+    qsort(sc.entries, sc.count, sizeof(meta_t), compare_meta);
+    return sc;
+}
+
+void free_scan(scan_t *sc) {
+    size_t i;
+
+    for (i = 0; i < sc->count; ++i)
+        free(sc->entries[i].path);
+    free(sc->entries);
+    sc->entries = NULL;
+    sc->count = 0;
+}
+
+void free_index(dir_index_t *index) {
+    size_t i;
+
+    for (i = 0; i < index->count; ++i)
+        if (!index->dirs[i].moved)
+            free_dir(&index->dirs[i]);
+    free(index->dirs);
+    index->dirs = NULL;
+    index->count = 0;
+}
+
+/* Add every file that is new in after, or changed since before, to wrote,
+ * unless it's already there. The paths added are copies.
+ */
+void compare_scans(const scan_t *before, const scan_t *after,
+        strings_t *wrote) {
+    size_t i = 0, j;
+
+    for (j = 0; j < after->count; ++j) {
+        const meta_t *a = &after->entries[j], *b = NULL;
+        char *copy;
+
+        while (i < before->count &&
+                strcmp(before->entries[i].path, a->path) < 0)
+            ++i;
+        if (i < before->count && !strcmp(before->entries[i].path, a->path))
+            b = &before->entries[i];
+        if (b && b->ino == a->ino && b->size == a->size &&
+                b->mtime.tv_sec == a->mtime.tv_sec &&
+                b->mtime.tv_nsec == a->mtime.tv_nsec &&
+                b->ctime.tv_sec == a->ctime.tv_sec &&
+                b->ctime.tv_nsec == a->ctime.tv_nsec)
+            continue;
+        if (contains(wrote, a->path))
+            continue;
+        copy = strdup(a->path);
+        if (!copy)
+            DIE("Out of memory.\n");
+        append(wrote, copy);
+    }
+}
@@ -1,23 +1,21 @@
 /* scrutineer, a Makefile validator.
  *
- * Run `scrutineer -h` for usage information.
+ * Run `scrutineer -h` for usage information. The work is done by
+ * libscrutineer; this is just its command line interface.
  *
  * This code is licensed under a CC BY-SA 3.0 licence. For more information see
  * the accompanying README.
  * Matthew Fernandez.
  */
-#include <utime.h>
-#include <time.h>
-#include <assert.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
-#include <sys/wait.h>
-#include <sys/stat.h>
-#include <sys/types.h>
 #include <string.h>
-#include <ctype.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include "scrutineer.h"
 
 /* Helper macro for bailing in the case of an unrecoverable error. */
 #define DIE(...) \
@@ -26,264 +24,464 @@
         exit(1); \
     } while (0)
 
-#define DEFAULT_CLEAN "make clean"
-#define DEFAULT_BUILD "make"
-
-typedef struct list {
-    const char *value;
-    struct list *next;
-    int phony; /* Whether this target is .PHONY or not. */
-} list_t;
-
-#ifdef __GNUC__
-    /* If we're using GCC, there are some annotations we can pass the compiler
-     * to help it optimise.
-     */
-    #ifndef _GNU_SOURCE
-    /* See comment about _GNU_SOURCE below. */
-    char *strndup(const char *s, size_t n) __attribute__((pure));
-    #endif
-    char **split(const char *s) __attribute__((pure));
-#endif
+/* Bail if a library call failed. */
+#define CHECK(s, call) \
+    do { \
+        if (call) \
+            DIE("%s\n", scrutineer_error(s)); \
+    } while (0)
 
-#ifndef _GNU_SOURCE
-/* If _GNU_SOURCE is defined then we will already have strndup from string.h.
- */
+/* Parse a non-negative integer command line argument. */
+static unsigned int parse_uint(const char *arg, const char *what) {
+    unsigned long v;
+    char *end;
 
-/* Copies at most n characters to a duplicate string. Result is '\0' terminated.
- */
-char *strndup(const char *s, size_t n) {
-    char *p;
-    size_t i;
+    errno = 0;
+    v = strtoul(arg, &end, 10);
+    if (errno || *arg == '\0' || *end != '\0' || v > UINT_MAX)
+        DIE("Invalid %s: %s.\n", what, arg);
+    return (unsigned int)v;
+}
 
-    p = (char*)malloc(sizeof(char) * (n + 1));
-    for (i = 0; *s != '\0' && i != n; ++i, ++s)
-        p[i] = *s;
-    p[i] = '\0';
+/* Our path, so make can run us as the parallel check's SHELL. */
+static char *self_path(const char *argv0) {
+    char buf[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
 
-    if (i != n)
-        /* We found a '\0' before the requested n characters. */
-        p = (char*)realloc(p, sizeof(char) * (i + 1));
+    if (len > 0) {
+        buf[len] = '\0';
+        return strdup(buf);
+    }
+    return realpath(argv0, NULL);
+}
 
-    return p;
+/* What we are printing. */
+typedef struct {
+    scrutineer_t *s;
+    int watching; /* Whether the initial assessment is over. */
+    int marker; /* Whether we've started a line of changes. */
+    int reverse; /* Whether we're listing the targets a change affects. */
+} output_t;
+
+/* While watching, print each target's changed dependencies as one line. */
+static void on_edge(void *data, const char *target, const char *dependency,
+        int added) {
+    output_t *o = (output_t*)data;
+
+    if (!o->watching)
+        return;
+    if (!o->marker++)
+        printf("%s:", target);
+    printf(" %c%s", added ? '+' : '-', dependency);
 }
-#endif
 
-/* Sets the modified time of a file. Returns 0 on success or -1 on failure.
- */
-int touch(const char *path, const time_t timestamp) {
-    const struct utimbuf t = {
-        .actime = timestamp,
-        .modtime = timestamp,
-    };
-    return utime(path, &t);
+static void on_progress(void *data, scrutineer_event_t event,
+        const char *target, const char *detail) {
+    output_t *o = (output_t*)data;
+
+    switch (event) {
+        case SCRUTINEER_TARGET_DONE: {
+            if (o->reverse) {
+                /* Affected targets were printed as we found them. */
+            } else if (o->watching) {
+                if (o->marker)
+                    printf("\n");
+                o->marker = 0;
+            } else {
+                scrutineer_status_t status = scrutineer_status(o->s, target);
+                const char *const *deps;
+                size_t n, i;
+
+                /* A target we gave up on part way may still have some
+                 * dependencies worth reporting.
+                 */
+                deps = scrutineer_dependencies(o->s, target, &n);
+                if (status == SCRUTINEER_ASSESSED ||
+                        (status == SCRUTINEER_FAILED && n > 0)) {
+                    printf("%s:", target);
+                    for (i = 0; i < n; ++i)
+                        printf(" %s", deps[i]);
+                    printf("\n");
+                }
+            }
+            fflush(stdout);
+            break;
+        } case SCRUTINEER_VERDICT: {
+            printf("%s: %s\n", target, detail);
+            fflush(stdout);
+            break;
+        } case SCRUTINEER_WARNING: {
+            fflush(stdout);
+            fprintf(stderr, "Warning: %s\n", detail);
+            break;
+        } case SCRUTINEER_AFFECTED: {
+            printf("%s\n", target);
+            fflush(stdout);
+            break;
+        } case SCRUTINEER_ESTIMATE: {
+            /* As a comment, so the output remains a valid Makefile
+             * fragment.
+             */
+            printf("# %s: %s\n", target, detail);
+            fflush(stdout);
+            break;
+        } case SCRUTINEER_WROTE: {
+            printf("# %s also writes %s\n", target, detail);
+            fflush(stdout);
+            break;
+        } case SCRUTINEER_OUTPUT: {
+            size_t len = strlen(detail);
+
+            fflush(stdout);
+            fprintf(stderr, "Output of the failed build of %s:\n%s%s", target,
+                detail, len > 0 && detail[len - 1] != '\n' ? "\n" : "");
+            break;
+        } default:
+            break;
+    }
 }
 
-/* Returns the modified time of a file. */
-time_t get_mtime(const char *path) {
-    struct stat buf;
-    int ret;
+/* The context to tidy up after if we are interrupted. */
+static scrutineer_t *volatile interrupted;
 
-    ret = stat(path, &buf);
-    return ret ? (time_t)0 : buf.st_mtime;
+/* Stop any builds, put the candidates' timestamps back, then die of the
+ * signal as usual.
+ */
+static void on_signal(int sig) {
+    scrutineer_signal(sig);
+    if (interrupted)
+        scrutineer_restore(interrupted);
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
-/* Returns 1 if a file exists and 0 otherwise. */
-inline int exists(const char *path) {
-    return !access(path, F_OK);
-}
+/* Print the targets with a given status on one line after label. */
+static void print_status(scrutineer_t *s, scrutineer_status_t status,
+        const char *label) {
+    size_t n = scrutineer_target_count(s), i;
+    int marker = 0;
 
-/* Split a string into an array of words terminated by a null entry.
- */
-char **split(const char *s) {
-    unsigned int i, j;
-    char **parts = NULL;
-    unsigned int sz = 0;
-
-    /* Whether we're inside a singly-quoted string. */
-    int in_s_quote = 0;
-
-    /* Whether we're inside a doubly-quoted string. */
-    int in_d_quote = 0;
-
-    for (i = 0, j = 0; s[i] != '\0'; ++i) {
-
-        /* Find the next space or end of string. */
-        for (j = i; s[j] != '\0' &&
-                   (s[j] != ' ' || in_s_quote || in_d_quote); ++j) {
-            if (s[j] == '\'' && !in_d_quote)
-                in_s_quote = !in_s_quote;
-            else if (s[j] == '\"' && !in_s_quote)
-                in_d_quote = !in_d_quote;
+    for (i = 0; i < n; ++i) {
+        const char *target = scrutineer_target(s, i);
+
+        if (scrutineer_status(s, target) == status) {
+            if (!marker) {
+                printf("%s", label);
+                marker = 1;
+            }
+            printf(" %s", target);
         }
+    }
+    /* If we found at least one such target. */
+    if (marker) printf("\n");
+}
 
-        if (s[i] == '\'' || s[i] == '\"')
-            /* Jump a leading quote. */
-            ++i;
+/* Long options without a short equivalent. */
+enum {
+    OPT_ROUNDS = 256,
+    OPT_JITTER,
+    OPT_DEPFILES,
+    OPT_BACKEND,
+    OPT_WATCH,
+    OPT_MAKEFILE,
+    OPT_SINCE,
+    OPT_GRAPH,
+    OPT_SAVE,
+    OPT_PREFILTER,
+    OPT_SAMPLE,
+    OPT_EVALUATE,
+    OPT_JOURNAL,
+    OPT_RESUME,
+    OPT_TIMEOUT,
+    OPT_RETRIES,
+    OPT_BUDGET,
+    OPT_ESTIMATE,
+    OPT_REVERSE,
+    OPT_SIDE_OUTPUTS,
+    OPT_CONTENT,
+    OPT_STAGE,
+    OPT_WORKERS,
+    OPT_PROFILE,
+    OPT_ADAPT,
+    OPT_MAX_LOAD,
+    OPT_MAX_STALL,
+};
 
-        if (i != j) {
-            /* Only add this item if we've found something more than a single
-             * space.
-             */
+int main(int argc, char **argv) {
+    scrutineer_t *s;
+    output_t o = { NULL, 0, 0, 0 };
+    int c;
+    int output_phony = 0;
+    int have_targets = 0, have_files = 0;
+    unsigned int strategy = 0;
+    char *self;
 
-            if (s[j - 1] == '\'' || s[j - 1] == '\"')
-                /* Drop a trailing quote. Note that this check is done after the
-                 * i != j check so that we know we're not reversing i and j in
-                 * the case of a trailing quote on a line. Also this has the
-                 * potentially unexpected behaviour of interpreting unclosed
-                 * quotes as closed by \0.
-                 */
-                --j;
+    /* Whether to keep watching for changes after the initial assessment. */
+    int watching = 0;
 
-            parts = (char**)realloc(parts, sizeof(char**) * (sz + 1));
-            parts[sz] = strndup(s + i, j - i);
-            ++sz;
-        }
+    /* A revision range and a previous graph to limit assessment to, and
+     * where to save the new graph.
+     */
+    const char *since = NULL, *graph = NULL, *save = NULL;
 
-        /* We may need to jump back over a quote that we skipped. */
-        if (s[j] == '\"' || s[j] == '\'') ++j;
+    /* Where to keep a journal, and whether to carry on from it. */
+    const char *journal = NULL;
+    int resume = 0;
 
-        /* If we're at the end of the string setting i=j will cause a buffer
-         * overflow in the next iteration of the loop.
-         */
-        if (s[j] == '\0') break;
+    /* Where to keep what builds cost. */
+    const char *profile = NULL;
 
-        /* Jump the word we've just extracted. */
-        i = j;
-    }
+    /* How many candidates to sample per target, if estimating. */
+    unsigned int estimating = 0;
 
-    /* Append NULL. */
-    parts = (char**)realloc(parts, sizeof(char**) * (sz + 1));
-    parts[sz] = NULL;
+    /* Whether to report what builds write besides their targets. */
+    int side_outputs = 0;
 
-    return parts;
-}
+    /* Where to build a copy of the working directory, if anywhere. */
+    const char *staging = NULL;
 
-/* Returns a time approximating now that is not the value not. The idea behind
- * this is that we need a value that is in the future (with respect to not),
- * but we don't care how far in the future.
- */
-time_t get_now(time_t not) {
-    time_t ret;
-    while ((ret = time(NULL)) <= not) usleep(100);
-    return ret;
-}
+    /* How long each build may take, and how often to try again. */
+    unsigned int timeout = 0, retries = 0;
 
-/* Run the given command and return the exit code. */
-int run(char *const argv[]) {
-    pid_t proc;
+    /* Settings for the parallel safety check. */
+    unsigned int jobs = 0;
+    unsigned int rounds = 1;
+    unsigned int jitter = 20000;
 
-#ifndef NDEBUG
-    /* Check the arguments we're about to exec are NULL-terminated. It's
-     * debatable how useful this check is as it should just crash out with a
-     * segfault, which is what execvp would have done anyway. At least we can
-     * ensure execvp doesn't even begin execution.
+    /* Whether to adapt how much the parallel check builds at once to the
+     * load, and how much to allow.
      */
-    int i = 0;
-    while (argv[i++]);
-#endif
+    int adapt = 0;
+    unsigned int max_load = 0, max_stall = 0;
+
+    static const struct option options[] = {
+        { "jobs", required_argument, NULL, 'j' },
+        { "rounds", required_argument, NULL, OPT_ROUNDS },
+        { "jitter", required_argument, NULL, OPT_JITTER },
+        { "workers", required_argument, NULL, OPT_WORKERS },
+        { "adapt", no_argument, NULL, OPT_ADAPT },
+        { "max-load", required_argument, NULL, OPT_MAX_LOAD },
+        { "max-stall", required_argument, NULL, OPT_MAX_STALL },
+        { "depfiles", no_argument, NULL, OPT_DEPFILES },
+        { "backend", required_argument, NULL, OPT_BACKEND },
+        { "watch", no_argument, NULL, OPT_WATCH },
+        { "makefile", required_argument, NULL, OPT_MAKEFILE },
+        { "since", required_argument, NULL, OPT_SINCE },
+        { "graph", required_argument, NULL, OPT_GRAPH },
+        { "save", required_argument, NULL, OPT_SAVE },
+        { "prefilter", no_argument, NULL, OPT_PREFILTER },
+        { "sample", required_argument, NULL, OPT_SAMPLE },
+        { "evaluate", no_argument, NULL, OPT_EVALUATE },
+        { "journal", required_argument, NULL, OPT_JOURNAL },
+        { "resume", no_argument, NULL, OPT_RESUME },
+        { "profile", required_argument, NULL, OPT_PROFILE },
+        { "timeout", required_argument, NULL, OPT_TIMEOUT },
+        { "retries", required_argument, NULL, OPT_RETRIES },
+        { "budget", required_argument, NULL, OPT_BUDGET },
+        { "estimate", required_argument, NULL, OPT_ESTIMATE },
+        { "reverse", no_argument, NULL, OPT_REVERSE },
+        { "side-outputs", no_argument, NULL, OPT_SIDE_OUTPUTS },
+        { "content", no_argument, NULL, OPT_CONTENT },
+        { "stage", optional_argument, NULL, OPT_STAGE },
+        { NULL, 0, NULL, 0 },
+    };
 
-    /* Without flushing stdout/stderr before forking, both parent and child
-     * process inherit anything in the buffers and eventually end up flushing
-     * (two copies of) it.
+    /* Are we being run as make's SHELL by the parallel safety check, or to
+     * see which recipes run?
      */
-    fflush(stdout);
-    fflush(stderr);
-
-    proc = fork();
-    if (proc == 0) {
-        /* Child process. */
-
-        /* Supress our output. */
-        stdout = freopen("/dev/null", "w", stdout);
-        assert(stdout);
-        stderr = freopen("/dev/null", "w", stderr);
-        assert(stderr);
-        stdin = freopen("/dev/null", "r", stdin);
-        assert(stdin);
-
-        (void)execvp(argv[0], argv);
-
-        /* If we reach this point execvp failed. */
-        exit(1);
-    } else if (proc > 0) {
-        /* Parent process. */
-        int status;
-
-        switch (wait(&status)) {
-            case -1:
-                /* Terminated by signal to me. Fall through. */
-            case 0: {
-                /* Status unavailable. */
-                return errno;
-                break;
-            } default: {
-                /* wait returned proc; expected. */
-                return status;
-                break;
-            }
-        }
-    } else
-        /* Fork failed. */
-        return errno;
-}
-
-
-int main(int argc, char **argv) {
-    time_t now, old;
-    list_t *p, *p1;
-    char **clean = NULL;
-    char **build = NULL;
-    unsigned int target_arg;
-    int c;
-    int output_phony = 0;
+    if (getenv("SCRUTINEER_JITTER") || getenv("SCRUTINEER_MARKER"))
+        return scrutineer_shim(argv);
 
-    /* A list of potential dependencies for each target. */
-    list_t *dependencies = NULL;
-
-    /* A list of targets to assess. */
-    list_t *targets = NULL;
+    s = scrutineer_new();
+    if (!s)
+        DIE("Out of memory.\n");
+    o.s = s;
+    interrupted = s;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
 
     /* Parse the command line arguments. */
-    while ((c = getopt(argc, argv, "b:c:t:d:phw:")) != -1) {
+    while ((c = getopt_long(argc, argv, "b:c:t:d:phw:j:", options, NULL))
+            != -1) {
         switch (c) {
             case 'b': { /* build action */
-                if (build)
-                    DIE("Multiple build actions specified.\n");
-                build = split(optarg);
+                CHECK(s, scrutineer_set_build(s, optarg));
                 break;
             } case 'c': { /* clean action */
-                if (clean)
-                    DIE("Multiple clean actions specified.\n");
-                clean = split(optarg);
+                CHECK(s, scrutineer_set_clean(s, optarg));
                 break;
             } case 't': { /* target */
-                list_t *temp;
-                temp = (list_t*) malloc(sizeof(list_t));
-                temp->value = optarg;
-                temp->next = targets;
-                temp->phony = 0;
-                targets = temp;
+                CHECK(s, scrutineer_add_target(s, optarg));
+                have_targets = 1;
                 break;
             } case 'd': { /* potential dependency */
-                list_t *temp;
-                temp = (list_t*) malloc(sizeof(list_t));
-                temp->value = optarg;
-                temp->next = dependencies;
-                /* ->phony is irrelevant for dependencies. */
-                dependencies = temp;
+                CHECK(s, scrutineer_add_candidate(s, optarg));
+                have_files = 1;
                 break;
             } case 'h': { /* help */
                 printf("Usage: %s options\n"
-                    " -b build     A custom command to build (default \"make <target>\").\n"
-                    " -c clean     A custom command to clean (default \"make clean\").\n"
-                    " -d file      A file to consider as a potential dependency.\n"
-                    " -h           Print usage information and exit.\n"
-                    " -p           Include .PHONY target after assessing real ones.\n"
-                    " -t target    A Makefile target to assess.\n"
-                    " -w directory Set the working directory before building.\n",
+                    " -b build       A custom command to build (default \"make <target>\").\n"
+                    " -c clean       A custom command to clean (default \"make clean\").\n"
+                    " -d file        A file to consider as a potential dependency.\n"
+                    " -h             Print usage information and exit.\n"
+                    " -j, --jobs n   Instead of probing dependencies, check each target\n"
+                    "                builds the same serially as with make -jn.\n"
+                    " -p             Include .PHONY target after assessing real ones.\n"
+                    " -t target      A Makefile target to assess.\n"
+                    " -w directory   Set the working directory before building.\n"
+                    " --backend name The build system, make or ninja (default ninja if\n"
+                    "                there is a build.ninja and no Makefile, else make).\n"
+                    " --depfiles     Confirm dependencies listed in .d files written by\n"
+                    "                the initial build and group test the rest.\n"
+                    " --evaluate     Work out dependencies from the build rules instead\n"
+                    "                of probing, checking the answer with a few builds.\n"
+                    " --content      Also count a target as rebuilt when its recipe runs\n"
+                    "                but keeps its timestamp (e.g. cp -p).\n"
+                    " --stage[=dir]  Build in a copy of the working directory made in\n"
+                    "                dir (default /dev/shm), leaving the original alone.\n"
+                    " --journal file Record progress in a journal, so the run can be\n"
+                    "                resumed if it is interrupted.\n"
+                    " --resume       Carry on from where the --journal left off.\n"
+                    " --profile file Keep how long targets take to build in a file,\n"
+                    "                and use it to plan later runs.\n"
+                    " --timeout secs Kill a build that takes longer than secs, and give\n"
+                    "                up on its target (default no limit).\n"
+                    " --retries n    Try a build that timed out up to n more times\n"
+                    "                before giving up (default 0).\n"
+                    " --budget secs  Stop probing after secs, having probed the likeliest\n"
+                    "                dependencies first (default no limit).\n"
+                    " --reverse      Instead, list the targets that touching all the\n"
+                    "                files rebuilds, checking them in a single build\n"
+                    "                (default every target the default build makes).\n"
+                    " --estimate n   Only probe a sample of n files per target, and\n"
+                    "                estimate how many files the --depfiles say it uses\n"
+                    "                do not rebuild it.\n"
+                    " --side-outputs Also list the other files each target's builds\n"
+                    "                create or modify.\n"
+                    " --graph file   A graph saved by an earlier run, for use with --since.\n"
+                    " --save file    Save the dependencies found to a file.\n"
+                    " --since range  Only probe targets that files changed in a git\n"
+                    "                revision range could affect.\n"
+                    " --prefilter    Only probe files the build rules could lead to from\n"
+                    "                each target.\n"
+                    " --sample n     With --prefilter, also probe n of the files it rules\n"
+                    "                out, to check the rules tell the whole story. With\n"
+                    "                --evaluate, check n of the predicted dependencies.\n"
+                    " --makefile f   A build file to watch (default whichever of Makefile,\n"
+                    "                makefile, GNUmakefile and build.ninja exist).\n"
+                    " --watch        Keep watching the build files and components, and\n"
+                    "                print how dependencies change when they are edited.\n"
+                    " --jitter usecs Delay each recipe in a parallel build by a random\n"
+                    "                time of up to usecs (default 20000).\n"
+                    " --rounds n     Parallel builds to try per target (default 1).\n"
+                    " --workers n    Check up to n targets at once (default 1).\n"
+                    " --adapt        Check fewer targets at once while the machine is\n"
+                    "                busy, and up to --workers when it isn't.\n"
+                    " --max-load n   With --adapt, keep the tasks waiting to run below n\n"
+                    "                (default one per CPU).\n"
+                    " --max-stall p  With --adapt, keep the time spent waiting on CPU,\n"
+                    "                memory or IO below p percent (default 10).\n",
                     argv[0]);
                 return 0;
+            } case 'j': { /* parallel safety check */
+                jobs = parse_uint(optarg, "number of jobs");
+                if (jobs < 2)
+                    DIE("The parallel check needs at least 2 jobs.\n");
+                break;
+            } case OPT_ROUNDS: {
+                rounds = parse_uint(optarg, "number of rounds");
+                if (rounds == 0)
+                    DIE("The parallel check needs at least 1 round.\n");
+                break;
+            } case OPT_JITTER: {
+                jitter = parse_uint(optarg, "jitter");
+                break;
+            } case OPT_WORKERS: {
+                scrutineer_set_workers(s, parse_uint(optarg,
+                    "number of workers"));
+                break;
+            } case OPT_ADAPT: {
+                adapt = 1;
+                break;
+            } case OPT_MAX_LOAD: {
+                max_load = parse_uint(optarg, "load");
+                break;
+            } case OPT_MAX_STALL: {
+                max_stall = parse_uint(optarg, "stall percentage");
+                if (max_stall == 0 || max_stall > 100)
+                    DIE("--max-stall needs a percentage from 1 to 100.\n");
+                break;
+            } case OPT_DEPFILES: {
+                strategy |= SCRUTINEER_DEPFILES;
+                break;
+            } case OPT_PREFILTER: {
+                strategy |= SCRUTINEER_PREFILTER;
+                break;
+            } case OPT_JOURNAL: {
+                journal = optarg;
+                break;
+            } case OPT_RESUME: {
+                resume = 1;
+                break;
+            } case OPT_PROFILE: {
+                profile = optarg;
+                break;
+            } case OPT_TIMEOUT: {
+                timeout = parse_uint(optarg, "timeout");
+                break;
+            } case OPT_RETRIES: {
+                retries = parse_uint(optarg, "number of retries");
+                break;
+            } case OPT_BUDGET: {
+                scrutineer_set_budget(s, parse_uint(optarg, "budget"));
+                break;
+            } case OPT_REVERSE: {
+                o.reverse = 1;
+                break;
+            } case OPT_SIDE_OUTPUTS: {
+                side_outputs = 1;
+                scrutineer_set_side_outputs(s, 1);
+                break;
+            } case OPT_ESTIMATE: {
+                estimating = parse_uint(optarg, "sample size");
+                if (estimating == 0)
+                    DIE("--estimate needs a sample of at least 1.\n");
+                scrutineer_set_estimate(s, estimating);
+                break;
+            } case OPT_CONTENT: {
+                strategy |= SCRUTINEER_CONTENT;
+                break;
+            } case OPT_STAGE: {
+                staging = optarg ? optarg : "/dev/shm";
+                break;
+            } case OPT_EVALUATE: {
+                strategy |= SCRUTINEER_EVALUATE;
+                break;
+            } case OPT_SAMPLE: {
+                scrutineer_set_sample(s, parse_uint(optarg, "sample size"));
+                break;
+            } case OPT_WATCH: {
+#ifdef __linux__
+                watching = 1;
+#else
+                DIE("--watch is only supported on Linux.\n");
+#endif
+                break;
+            } case OPT_MAKEFILE: {
+                CHECK(s, scrutineer_add_makefile(s, optarg));
+                break;
+            } case OPT_SINCE: {
+                since = optarg;
+                break;
+            } case OPT_GRAPH: {
+                graph = optarg;
+                break;
+            } case OPT_SAVE: {
+                save = optarg;
+                break;
+            } case OPT_BACKEND: {
+                CHECK(s, scrutineer_set_backend(s, optarg));
+                break;
             } case 'p': { /* output PHONY rule. */
                 output_phony = 1;
                 break;
@@ -293,6 +491,7 @@ int main(int argc, char **argv) {
             } case 'w': { /* Change working directory. */
                 if (chdir(optarg))
                     DIE("Failed to change directory to %s.\n", optarg);
+                break;
             } default: { /* getopt failure */
                 DIE("Failed to parse command line arguments.\n");
                 break;
@@ -300,143 +499,100 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (!targets)
+    if (!have_targets && !o.reverse)
         DIE("No targets specified.\n");
 
-    if (!dependencies)
+    if (!have_files && !jobs)
         DIE("No files specified.\n");
 
-    /* Setup clean arguments. */
-    if (!clean)
-        clean = split(DEFAULT_CLEAN);
-
-    /* Setup build arguments. */
-    if (!build)
-        build = split(DEFAULT_BUILD);
-
-    /* Figure out where the "target" argument should go and make room for it. */
-    for (target_arg = 0; build[target_arg]; ++target_arg);
-    build = (char**)realloc(build, sizeof(char**) * (target_arg + 2));
-    build[target_arg + 1] = NULL;
-    /* Now build[target_arg] is the "target" argument's place. */
-
-    /* Initial clean. */
-    if (run(clean))
-        DIE("Error: Clean failed.\n");
-
-    /* Check all the files we were passed actually exist. */
-    for (p1 = dependencies; p1; p1 = p1->next) {
-        assert(p1->value);
-        if (!exists(p1->value))
-            DIE("Component %s doesn't exist after cleaning. "
-                "Is it an intermediate file?\n", p1->value);
-    }
+    if (since && !graph)
+        DIE("--since needs a --graph from an earlier run.\n");
 
-    /* Build each target multiple times (touching different files in between)
-     * to determine dependencies. Note that the initial build of each target is
-     * discarded unless it fails because it tells us nothing about
-     * dependencies.
-     */
-    for (p = targets; p; p = p->next) {
-
-        /* Initial build to set the stage. */
-        assert(p->value);
-        build[target_arg] = (char*)p->value;
-        if (run(build)) {
-            fprintf(stderr,
-                "Warning: Failed to build %s from scratch. Broken %s recipe?\n",
-                p->value, p->value);
-            continue;
-        }
+    if (resume && !journal)
+        DIE("--resume needs the --journal of the run to resume.\n");
 
-        /* We shouldn't know whether this target is phony yet. */
-        assert(!p->phony);
+    if (journal)
+        CHECK(s, scrutineer_set_journal(s, journal, resume));
 
-        if (!exists(p->value)) {
-            fprintf(stderr,
-                "Warning: %s appears to be PHONY! I can't assess this.\n",
-                p->value);
-            p->phony = 1;
-            continue;
-        }
+    if (profile)
+        CHECK(s, scrutineer_set_profile(s, profile));
 
-        /* Touch every component so we have a known starting point. */
-        now = get_now((time_t)0);
-        for (p1 = dependencies; p1; p1 = p1->next) {
-            assert(p1->value);
-            if (exists(p1->value)) {
-                if (touch(p1->value, now))
-                    DIE("Could not update timestamp for %s.\n", p1->value);
-            } else
-                fprintf(stderr, "Warning: component %s now doesn't exist, "
-                        "although cleaning does not seem to delete it. "
-                        "Destructive recipe somewhere in your Makefile?\n",
-                        p1->value);
-        }
+    if (estimating && (save || since || watching))
+        DIE("--estimate only finds some dependencies, so it can't be used "
+            "with --save, --since or --watch.\n");
 
-        /* Touch the target to make sure it is considered up to date with
-         * respect to all the potential dependencies. Note, this is here
-         * because the target may not actually be in the user-provided list of
-         * files.
-         */
-        assert(exists(p->value));
-        if (touch(p->value, now)) {
-            fprintf(stderr, "Could not update timestamp for %s (cannot "
-                "determine dependencies).\n", p->value);
-            continue;
-        }
+    if (o.reverse && (jobs || since || watching || save || estimating))
+        DIE("--reverse can't be combined with --jobs, --since, --watch, "
+            "--save or --estimate.\n");
 
-        /* The target should not be phony if we've reached this point. */
-        assert(!p->phony);
-
-        printf("%s:", p->value);
-        old = now; /* The timestamp we've marked each file with. */
-        for (p1 = dependencies; p1; p1 = p1->next) {
-            now = get_now(old);
-            assert(p1->value);
-            assert(now > old);
-            assert(exists(p1->value));
-            assert(get_mtime(p->value) == old);
-            touch(p1->value, now);
-
-            if (run(build))
-                DIE("Error: Failed to build %s after touching %s.\n", p->value,
-                    p1->value);
-
-            if (!exists(p->value))
-                DIE("Error: %s, that was NOT a phony target, was removed when "
-                    "building after touching %s. Broken recipe for %s?\n",
-                    p->value, p1->value, p->value);
-
-            now = get_mtime(p->value);
-            assert(now >= old); /* Check we haven't gone back in time. */
-            if (now != old) {
-                /* The target was rebuilt. */
-                printf(" %s", p1->value);
-                old = now;
-            }
+    if (side_outputs && (jobs || o.reverse))
+        DIE("--side-outputs can't be combined with --jobs or --reverse.\n");
+
+    if (retries && !timeout)
+        DIE("--retries needs a --timeout.\n");
+
+    if ((max_load || max_stall) && !adapt)
+        DIE("--max-load and --max-stall need --adapt.\n");
+
+    if (adapt && !jobs)
+        DIE("--adapt is for the parallel check, with --jobs.\n");
+
+    if (staging && watching)
+        DIE("--stage can't be combined with --watch.\n");
+
+    /* After -w, which says what to copy. */
+    if (staging)
+        CHECK(s, scrutineer_stage(s, staging));
+
+    scrutineer_set_strategy(s, strategy);
+    scrutineer_set_timeout(s, timeout, retries);
+    scrutineer_set_adaptive(s, adapt, max_load, max_stall);
+    scrutineer_on_edge(s, on_edge, &o);
+    scrutineer_on_progress(s, on_progress, &o);
+
+    if (jobs || (strategy & SCRUTINEER_CONTENT)) {
+        self = self_path(argv[0]);
+        if (self) {
+            CHECK(s, scrutineer_set_shim(s, self));
+            free(self);
         }
-        printf("\n");
+    }
 
-        /* Clean up. */
-        if (run(clean))
-            DIE("Error: Clean failed.\n");
+    if (jobs) {
+        CHECK(s, scrutineer_check_parallel(s, jobs, rounds, jitter));
+        scrutineer_free(s);
+        return 0;
     }
 
-    if (output_phony) {
-        int marker;
+    if (o.reverse) {
+        CHECK(s, scrutineer_run_reverse(s));
+        scrutineer_free(s);
+        return 0;
+    }
 
-        for (marker = 0, p = targets; p; p = p->next)
-            if (p->phony) {
-                if (!marker) {
-                    printf(".PHONY:");
-                    marker = 1;
-                }
-                printf(" %s", p->value);
-            }
-        /* If we found at least one phony target. */
-        if (marker) printf("\n");
+    if (since)
+        CHECK(s, scrutineer_run_since(s, since, graph));
+    else
+        CHECK(s, scrutineer_run(s));
+
+    if (output_phony)
+        print_status(s, SCRUTINEER_PHONY, ".PHONY:");
+
+    /* List the targets we skipped for always being rebuilt. This is emitted
+     * as a comment so the output remains a valid Makefile fragment.
+     */
+    print_status(s, SCRUTINEER_DIRTY, "# Always rebuilt:");
+    print_status(s, SCRUTINEER_UNASSESSED, "# Not assessed in time:");
+
+    if (save)
+        CHECK(s, scrutineer_save(s, save));
+
+    if (watching) {
+        fflush(stdout);
+        o.watching = 1;
+        CHECK(s, scrutineer_watch(s));
     }
 
+    scrutineer_free(s);
     return 0;
 }
@@ -0,0 +1,325 @@
+/* libscrutineer, the Makefile validator as a library.
+ *
+ * Typical use is to create a context, tell it about the targets to assess and
+ * the files that might be their dependencies, register callbacks for the
+ * results and then run it:
+ *
+ *     scrutineer_t *s = scrutineer_new();
+ *     scrutineer_add_target(s, "prog");
+ *     scrutineer_add_candidate(s, "main.c");
+ *     scrutineer_on_edge(s, my_edge_callback, my_data);
+ *     if (scrutineer_run(s))
+ *         fprintf(stderr, "%s\n", scrutineer_error(s));
+ *     scrutineer_free(s);
+ *
+ * Builds run in the current working directory. Functions returning int
+ * return 0 on success and -1 on failure, after which scrutineer_error
+ * describes what went wrong. A context is not safe to use from more than one
+ * thread at a time.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#ifndef SCRUTINEER_H
+#define SCRUTINEER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __GNUC__
+    #define SCRUTINEER_API __attribute__((visibility("default")))
+#else
+    #define SCRUTINEER_API
+#endif
+
+typedef struct scrutineer scrutineer_t;
+
+/* What we learnt about a target. */
+typedef enum {
+    SCRUTINEER_UNASSESSED, /* Not assessed (yet). */
+    SCRUTINEER_ASSESSED, /* Its dependencies are known. */
+    SCRUTINEER_PHONY, /* It does not produce a file of its name. */
+    SCRUTINEER_DIRTY, /* It is rebuilt even when nothing has changed. */
+    SCRUTINEER_FAILED, /* It failed to build, or a build timed out. */
+} scrutineer_status_t;
+
+/* Things we tell progress callbacks about. */
+typedef enum {
+    SCRUTINEER_TARGET_START, /* About to assess target. */
+    SCRUTINEER_TARGET_DONE, /* Finished with target; see its status. */
+    SCRUTINEER_PROBE, /* About to build target after touching detail. */
+    SCRUTINEER_WARNING, /* Something looks wrong; detail says what. */
+    SCRUTINEER_VERDICT, /* detail is the parallel check's verdict on target. */
+    SCRUTINEER_OUTPUT, /* detail is the end of what a failed build wrote. */
+    SCRUTINEER_ESTIMATE, /* detail summarises the estimate for target. */
+    SCRUTINEER_AFFECTED, /* Touching the candidates rebuilt target. */
+    SCRUTINEER_WROTE, /* Building target also wrote the file detail. */
+} scrutineer_event_t;
+
+/* What sampling a target's candidates suggests about all of them. */
+typedef struct {
+    size_t candidates; /* How many there were. */
+    size_t sampled; /* How many were probed. */
+    size_t found; /* Dependencies among those probed. */
+    size_t missing; /* Files probed that the target uses but that touching
+                     * did not rebuild it.
+                     */
+    int known; /* Whether depfiles or the build system told us what the
+                * target uses. If not, missing counts every dependency
+                * found instead.
+                */
+    double rate; /* The estimated fraction of candidates counted in missing.
+                  */
+    double low, high; /* A 95% confidence interval for rate. */
+} scrutineer_estimate_t;
+
+/* Ways of finding dependencies, to combine with |. */
+enum {
+    /* Confirm the dependencies in .d files written by the initial build and
+     * group test the rest.
+     */
+    SCRUTINEER_DEPFILES = 1 << 0,
+
+    /* Only probe candidates that the build system's rules could lead to from
+     * each target.
+     */
+    SCRUTINEER_PREFILTER = 1 << 1,
+
+    /* Decide what each target depends on from the build system's rules
+     * without building, then check the answer with a few real builds.
+     */
+    SCRUTINEER_EVALUATE = 1 << 2,
+
+    /* Also count a target as rebuilt when its recipe ran but kept its
+     * timestamp, as cp -p, install -p and recipes that only write what
+     * changed do. With make, recipes are run through the shim (see
+     * scrutineer_set_shim) to see which ran; otherwise the target's
+     * contents are compared when its timestamp, size and inode are the same.
+     */
+    SCRUTINEER_CONTENT = 1 << 3,
+};
+
+/* Called when target is found to depend on dependency (added is 1) or, when
+ * watching for changes, no longer to (added is 0).
+ */
+typedef void (*scrutineer_edge_fn)(void *data, const char *target,
+    const char *dependency, int added);
+
+/* Called as assessment progresses. target or detail may be NULL. */
+typedef void (*scrutineer_progress_fn)(void *data, scrutineer_event_t event,
+    const char *target, const char *detail);
+
+/* Create or destroy a context. */
+SCRUTINEER_API scrutineer_t *scrutineer_new(void);
+SCRUTINEER_API void scrutineer_free(scrutineer_t *s);
+
+/* Put back the timestamps of candidates that assessment touched, unless they
+ * have changed since, so the next build doesn't redo everything. Runs do this
+ * themselves when they finish or fail, as does scrutineer_free. This is safe
+ * to call from a signal handler, to cover a run that is interrupted.
+ */
+SCRUTINEER_API void scrutineer_restore(scrutineer_t *s);
+
+/* Pass sig on to the builds in flight. With a timeout, each runs in a process
+ * group of its own, which signals sent to us, or to the terminal's foreground
+ * group, don't reach. This is safe to call from a signal handler, before
+ * scrutineer_restore.
+ */
+SCRUTINEER_API void scrutineer_signal(int sig);
+
+/* Describe the last failure. */
+SCRUTINEER_API const char *scrutineer_error(const scrutineer_t *s);
+
+/* Configuration. The build system is "make" or "ninja"; by default ninja is
+ * used if there is a build.ninja and no Makefile. Commands are split into
+ * words like a shell would, and the target is appended to the build command.
+ * By default they come from the build system.
+ */
+SCRUTINEER_API int scrutineer_set_backend(scrutineer_t *s, const char *name);
+SCRUTINEER_API int scrutineer_set_build(scrutineer_t *s, const char *command);
+SCRUTINEER_API int scrutineer_set_clean(scrutineer_t *s, const char *command);
+SCRUTINEER_API int scrutineer_add_target(scrutineer_t *s, const char *target);
+SCRUTINEER_API int scrutineer_add_candidate(scrutineer_t *s,
+    const char *path);
+SCRUTINEER_API int scrutineer_add_makefile(scrutineer_t *s,
+    const char *path);
+SCRUTINEER_API void scrutineer_set_strategy(scrutineer_t *s,
+    unsigned int strategy);
+
+/* With SCRUTINEER_PREFILTER, also probe up to n randomly chosen candidates
+ * the rules rule out, to check the rules tell the whole story. If one turns
+ * out to be a dependency after all, every other candidate is probed too.
+ * With SCRUTINEER_EVALUATE, check n of the dependencies the rules predict
+ * (default 1).
+ */
+SCRUTINEER_API void scrutineer_set_sample(scrutineer_t *s, unsigned int n);
+
+/* Stop probing once scrutineer_run or scrutineer_run_since has taken
+ * seconds (default 0, no limit). Candidates are probed likeliest first, so
+ * the dependencies found by then are the ones most worth having. A target
+ * that was cut short is left SCRUTINEER_FAILED and any not reached are left
+ * SCRUTINEER_UNASSESSED.
+ */
+SCRUTINEER_API void scrutineer_set_budget(scrutineer_t *s,
+    unsigned int seconds);
+
+/* Instead of probing every candidate, probe a random sample of up to n of
+ * each target's (default 0, probe them all), spread across directories in
+ * proportion to how many candidates each has. The target's dependencies are
+ * then only those in the sample, and scrutineer_estimate says how many
+ * missing edges there are likely to be among all of them. That needs
+ * SCRUTINEER_DEPFILES, or a build system that records what targets use. A
+ * run takes a number of builds per target that depends on n, not on how
+ * many candidates there are.
+ */
+SCRUTINEER_API void scrutineer_set_estimate(scrutineer_t *s, unsigned int n);
+
+/* Look at the whole tree before and after every build and, when done with
+ * each target, report each file besides the target that its builds created
+ * or modified with SCRUTINEER_WROTE (default 0, don't). These side outputs,
+ * such as generated headers, depfiles and stamp files, are easy to leave out
+ * of the rules. Only file metadata is looked at, so this is cheap next to
+ * most builds.
+ */
+SCRUTINEER_API void scrutineer_set_side_outputs(scrutineer_t *s, int enable);
+
+/* Have the parallel check work on up to n targets at once (default 1), each
+ * in its own sandbox. A target whose serial build is done has its parallel
+ * builds shared between workers with nothing else to do. Progress is still
+ * reported on the calling thread, but targets' events may interleave.
+ */
+SCRUTINEER_API void scrutineer_set_workers(scrutineer_t *s, unsigned int n);
+
+/* Have the parallel check vary how many of its workers build at once with
+ * how busy the machine is, for when it shares the machine with other jobs
+ * (default 0, don't). Fewer build while the tasks waiting to run number more
+ * than max_load (0 for one per CPU) or, where the kernel reports pressure
+ * stalls, while anything is held up waiting on CPU, memory or IO for more
+ * than max_stall percent of the time (0 for 10%). Memory stalls halve the
+ * number at once, to keep out of swap. More build, up to the number of
+ * workers, once there has been room for them for a few seconds.
+ */
+SCRUTINEER_API void scrutineer_set_adaptive(scrutineer_t *s, int enable,
+    unsigned int max_load, unsigned int max_stall);
+
+/* Give each build seconds to finish (default 0, no limit). A build that
+ * takes longer is killed along with everything it started, and tried again
+ * up to retries times. If it never finishes in time, the target is left
+ * SCRUTINEER_FAILED with whatever dependencies were found so far and we move
+ * on to the next one. The parallel check reports a build that times out
+ * rather than trying it again.
+ */
+SCRUTINEER_API void scrutineer_set_timeout(scrutineer_t *s,
+    unsigned int seconds, unsigned int retries);
+
+/* Keep a journal of the probes scrutineer_run does at path, so that if it
+ * is interrupted a later run can resume from it. When resuming, the
+ * candidates' timestamps are put back the way they were at the start and
+ * anything the journal already knows is not probed again.
+ */
+SCRUTINEER_API int scrutineer_set_journal(scrutineer_t *s, const char *path,
+    int resume);
+
+/* Keep a profile at path of how long each target takes to build from
+ * scratch and how many dependencies it was found to have, reading what is
+ * there now and writing it back whenever a run finishes. The parallel check
+ * starts the targets it expects to take longest first, so they don't hold
+ * up the end of the run, and group testing splits a target's candidates
+ * into batches sized for the number of dependencies it had last time.
+ */
+SCRUTINEER_API int scrutineer_set_profile(scrutineer_t *s, const char *path);
+
+/* Build in a copy of the working directory made now under dir, preferably a
+ * tmpfs, for trees whose builds are held up by a slow disk. The working
+ * directory itself is left alone. This has to come before anything that
+ * builds, and moves the process into the copy until scrutineer_free, which
+ * removes it. The copy is removed however the process exits. Paths given to
+ * scrutineer_set_journal, scrutineer_run_since and scrutineer_save are still
+ * taken from the original working directory. If the tree looks too big for
+ * dir, or copying it fails, this warns and leaves builds where they were.
+ * A staged tree can't be watched.
+ */
+SCRUTINEER_API int scrutineer_stage(scrutineer_t *s, const char *dir);
+
+/* The program make should run as its SHELL during the parallel check and
+ * under SCRUTINEER_CONTENT. It must hand over to scrutineer_shim when
+ * SCRUTINEER_JITTER or SCRUTINEER_MARKER is set, like the scrutineer program
+ * does. The default is scrutineer from the PATH.
+ */
+SCRUTINEER_API int scrutineer_set_shim(scrutineer_t *s, const char *path);
+
+/* Register callbacks. Either may be NULL. Without a progress callback,
+ * warnings are printed to stderr.
+ */
+SCRUTINEER_API void scrutineer_on_edge(scrutineer_t *s, scrutineer_edge_fn fn,
+    void *data);
+SCRUTINEER_API void scrutineer_on_progress(scrutineer_t *s,
+    scrutineer_progress_fn fn, void *data);
+
+/* Assess every target. */
+SCRUTINEER_API int scrutineer_run(scrutineer_t *s);
+
+/* Assess only the targets that files changed in a git revision range could
+ * affect, taking everything else from a graph saved by an earlier run.
+ */
+SCRUTINEER_API int scrutineer_run_since(scrutineer_t *s, const char *range,
+    const char *graph);
+
+/* Instead of finding what each target depends on, find which targets depend
+ * on any of the candidates: touch them all at once and rebuild every target
+ * in a single build, reporting each one that is rebuilt with a
+ * SCRUTINEER_AFFECTED event. Without any targets added, every file the
+ * build system knows how to make that the default build produces is
+ * checked, and added to the targets.
+ */
+SCRUTINEER_API int scrutineer_run_reverse(scrutineer_t *s);
+
+/* Instead of finding dependencies, build each target serially and with
+ * make -jjobs, each rounds times with recipes delayed randomly by up to
+ * jitter microseconds, and report a verdict on each. This needs the make
+ * backend.
+ */
+SCRUTINEER_API int scrutineer_check_parallel(scrutineer_t *s,
+    unsigned int jobs, unsigned int rounds, unsigned int jitter);
+
+/* After running, keep watching the build files and candidates for changes
+ * and re-assess the targets they affect. Only returns on failure.
+ */
+SCRUTINEER_API int scrutineer_watch(scrutineer_t *s);
+
+/* Save the results to a file that scrutineer_run_since can read. */
+SCRUTINEER_API int scrutineer_save(scrutineer_t *s, const char *path);
+
+/* Query the results. Targets are numbered from 0. */
+SCRUTINEER_API size_t scrutineer_target_count(const scrutineer_t *s);
+SCRUTINEER_API const char *scrutineer_target(const scrutineer_t *s,
+    size_t index);
+SCRUTINEER_API scrutineer_status_t scrutineer_status(const scrutineer_t *s,
+    const char *target);
+SCRUTINEER_API const char *const *scrutineer_dependencies(
+    const scrutineer_t *s, const char *target, size_t *count);
+
+/* Whether scrutineer_run_reverse found target was rebuilt. */
+SCRUTINEER_API int scrutineer_affected(const scrutineer_t *s,
+    const char *target);
+
+/* The estimate for a target sampled under scrutineer_set_estimate. Returns
+ * NULL if there isn't one.
+ */
+SCRUTINEER_API const scrutineer_estimate_t *scrutineer_estimate(
+    const scrutineer_t *s, const char *target);
+
+/* The SHELL shim for the parallel check and SCRUTINEER_CONTENT. Notes the
+ * target whose recipe it is running or waits a random interval, and then runs
+ * the real shell with argv. Only returns on failure.
+ */
+SCRUTINEER_API int scrutineer_shim(char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,171 @@
+/* Building in a copy of the working directory on a tmpfs, for trees whose
+ * builds spend their time waiting on a slow disk.
+ *
+ * The copy has to go however we exit, including on a signal or an error that
+ * ends the process without freeing the context. So a sweeper process waits
+ * for us to go, whether or not we tell it, and removes the copy after us.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "internal.h"
+
+/* How much room to want per byte of the tree, leaving space for what the
+ * builds write.
+ */
+#define HEADROOM 2
+
+/* The memory the kernel thinks it could give us without swapping, in bytes,
+ * or ULLONG_MAX if it won't say.
+ */
+static unsigned long long available_memory(void) {
+    unsigned long long kb = 0;
+    char line[128];
+    FILE *f = fopen("/proc/meminfo", "r");
+
+    if (!f)
+        return ULLONG_MAX;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb ? kb * 1024 : ULLONG_MAX;
+}
+
+/* Returns 1 if a tree of size bytes should fit under dir. A tmpfs takes its
+ * room from memory, so we need that as well as space.
+ */
+static int fits(const char *dir, unsigned long long size) {
+    struct statvfs st;
+    unsigned long long want = size * HEADROOM;
+
+    if (statvfs(dir, &st))
+        DIE("Failed to look at %s.\n", dir);
+    return (unsigned long long)st.f_bavail * st.f_frsize >= want &&
+           available_memory() >= want;
+}
+
+/* The sweeper's side. Wait for gone to close, which happens when we are
+ * done with the copy or exit, then remove it.
+ */
+static void sweep(const char *copy, int gone) {
+    char c;
+    ssize_t r;
+
+    /* Interrupts are for our parent. We leave after it. */
+    (void)signal(SIGINT, SIG_IGN);
+    (void)signal(SIGTERM, SIG_IGN);
+    do
+        r = read(gone, &c, 1);
+    while (r != 0 && (r > 0 || errno == EINTR));
+    (void)remove_tree(copy);
+    _exit(0);
+}
+
+void stage(scrutineer_t *s, const char *dir) {
+    char root[PATH_MAX], *path, *tree, **paths[2];
+    size_t i;
+    int gone[2];
+    pid_t pid;
+
+    if (s->stage)
+        DIE("The working directory is already staged.\n");
+    if (s->prepared)
+        DIE("The working directory has to be staged before any builds.\n");
+    if (!fits(dir, tree_size("."))) {
+        warn("The working directory won't fit in %s, so building in place.\n",
+            dir);
+        return;
+    }
+
+    s->home = getcwd(NULL, 0);
+    if (!s->home)
+        DIE("Failed to find the working directory.\n");
+    /* Paths we were given relative to here have to stay that way. */
+    paths[0] = &s->journal_path;
+    paths[1] = &s->profile_path;
+    for (i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i)
+        if (*paths[i] && (*paths[i])[0] != '/') {
+            path = join(s->home, *paths[i]);
+            free(*paths[i]);
+            *paths[i] = path;
+        }
+
+    if (snprintf(root, sizeof(root), "%s/scrutineer.XXXXXX", dir) >=
+            (int)sizeof(root) || !mkdtemp(root))
+        DIE("Failed to create a directory in %s.\n", dir);
+    if (pipe2(gone, O_CLOEXEC)) {
+        (void)rmdir(root);
+        DIE("Failed to set up removing %s.\n", root);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        close(gone[1]);
+        sweep(root, gone[0]);
+    }
+    close(gone[0]);
+    if (pid < 0) {
+        close(gone[1]);
+        (void)rmdir(root);
+        DIE("Failed to set up removing %s.\n", root);
+    }
+    s->sweeper = pid;
+    s->gone = gone[1];
+    s->stage = strdup(root);
+    if (!s->stage)
+        DIE("Out of memory.\n");
+
+    /* copy_tree makes the directory it copies to. */
+    tree = join(root, "tree");
+    if (copy_tree(".", tree, NULL) || chdir(tree)) {
+        /* Probably out of room after all, but nothing is lost yet. */
+        unstage(s);
+        warn("Failed to copy the working directory to %s, so building in "
+            "place.\n", dir);
+    }
+    free(tree);
+}
+
+void unstage(scrutineer_t *s) {
+    if (!s->stage)
+        return;
+    if (chdir(s->home))
+        warn("failed to return to %s.\n", s->home);
+    /* Closing gone sets the sweeper off. */
+    close(s->gone);
+    s->gone = -1;
+    while (waitpid(s->sweeper, NULL, 0) < 0 && errno == EINTR);
+    s->sweeper = 0;
+    free(s->stage);
+    s->stage = NULL;
+    free(s->home);
+    s->home = NULL;
+}
+
+/* Where path, given relative to the original working directory, is from
+ * here. The caller owns the result.
+ */
+char *from_home(const scrutineer_t *s, const char *path) {
+    char *p;
+
+    if (s->stage && path[0] != '/')
+        return join(s->home, path);
+    p = strdup(path);
+    if (!p)
+        DIE("Out of memory.\n");
+    return p;
+}
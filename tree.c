@@ -0,0 +1,292 @@
+/* Copying, deleting and taking snapshots of directory trees.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+    #include <linux/fs.h>
+#endif
+#include "internal.h"
+
+/* Copy a regular file, preserving its mode and timestamps. Returns 0 on
+ * success or -1 on failure.
+ */
+int copy_file(const char *from, const char *to, const struct stat *st) {
+    char buf[BUFSIZ * 8];
+    ssize_t r;
+    int in, out, ret = -1;
+
+    in = open(from, O_RDONLY);
+    if (in < 0)
+        return -1;
+    out = open(to, O_WRONLY|O_CREAT|O_EXCL, st->st_mode & 07777);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+#ifdef FICLONE
+    /* Where the file system can share the data between the two, it is
+     * cheaper than reading and writing it.
+     */
+    if (!ioctl(out, FICLONE, in))
+        r = 0;
+    else
+#endif
+    while ((r = read(in, buf, sizeof(buf))) > 0)
+        if (write(out, buf, r) != r)
+            goto done;
+    if (r == 0) {
+        /* Timestamps have to match the original's exactly or make will see
+         * a different picture of what is up to date.
+         */
+        const struct timespec t[2] = { st->st_atim, st->st_mtim };
+        ret = futimens(out, t);
+    }
+
+done:
+    close(in);
+    if (close(out))
+        ret = -1;
+    return ret;
+}
+
+/* Recursively copy the directory from into the new directory to. Anything
+ * with the same device and inode as skip is not copied; this lets us place a
+ * sandbox inside the tree we are copying. Returns 0 on success or -1 on
+ * failure.
+ */
+int copy_tree(const char *from, const char *to, const struct stat *skip) {
+    DIR *d;
+    struct dirent *e;
+    struct stat st;
+    int ret = 0;
+
+    if (stat(from, &st) || mkdir(to, st.st_mode & 07777))
+        return -1;
+
+    d = opendir(from);
+    if (!d)
+        return -1;
+    while (!ret && (e = readdir(d))) {
+        char *src, *dst;
+
+        if (is_dot(e->d_name))
+            continue;
+        src = join(from, e->d_name);
+        dst = join(to, e->d_name);
+        if (lstat(src, &st))
+            ret = -1;
+        else if (skip && st.st_dev == skip->st_dev &&
+                 st.st_ino == skip->st_ino)
+            ; /* Ignore. */
+        else if (S_ISDIR(st.st_mode))
+            ret = copy_tree(src, dst, skip);
+        else if (S_ISREG(st.st_mode))
+            ret = copy_file(src, dst, &st);
+        else if (S_ISLNK(st.st_mode)) {
+            char link[PATH_MAX];
+            ssize_t len = readlink(src, link, sizeof(link) - 1);
+            if (len < 0)
+                ret = -1;
+            else {
+                link[len] = '\0';
+                ret = symlink(link, dst);
+            }
+        }
+        /* Anything else (sockets, fifos, devices) is not something a build
+         * should depend on, so we leave it out.
+         */
+        free(src);
+        free(dst);
+    }
+    closedir(d);
+    return ret;
+}
+
+/* Roughly how many bytes the tree under path takes up. */
+unsigned long long tree_size(const char *path) {
+    unsigned long long size;
+    struct stat st;
+    DIR *d;
+    struct dirent *e;
+
+    if (lstat(path, &st))
+        return 0;
+    size = (unsigned long long)st.st_blocks * 512;
+    if (!S_ISDIR(st.st_mode))
+        return size;
+
+    d = opendir(path);
+    if (!d)
+        return size;
+    while ((e = readdir(d))) {
+        char *p;
+
+        if (is_dot(e->d_name))
+            continue;
+        p = join(path, e->d_name);
+        size += tree_size(p);
+        free(p);
+    }
+    closedir(d);
+    return size;
+}
+
+/* Recursively delete a path. Returns 0 on success or -1 on failure. */
+int remove_tree(const char *path) {
+    struct stat st;
+    DIR *d;
+    struct dirent *e;
+    int ret = 0;
+
+    if (lstat(path, &st))
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path);
+
+    d = opendir(path);
+    if (!d)
+        return -1;
+    while ((e = readdir(d))) {
+        char *p;
+
+        if (is_dot(e->d_name))
+            continue;
+        p = join(path, e->d_name);
+        if (remove_tree(p))
+            ret = -1;
+        free(p);
+    }
+    closedir(d);
+    return rmdir(path) ? -1 : ret;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const entry_t*)a)->path, ((const entry_t*)b)->path);
+}
+
+/* Add every regular file under root/prefix to a snapshot. */
+static void walk(const char *root, const char *prefix, snapshot_t *s) {
+    char *dir;
+    DIR *d;
+    struct dirent *e;
+
+    dir = prefix ? join(root, prefix) : strdup(root);
+    d = opendir(dir);
+    if (!d)
+        DIE("Failed to read directory %s.\n", dir);
+    while ((e = readdir(d))) {
+        struct stat st;
+        char *rel, *full;
+
+        if (is_dot(e->d_name))
+            continue;
+        rel = prefix ? join(prefix, e->d_name) : strdup(e->d_name);
+        full = join(root, rel);
+        if (lstat(full, &st))
+            DIE("Failed to stat %s.\n", full);
+        if (S_ISDIR(st.st_mode)) {
+            walk(root, rel, s);
+            free(rel);
+        } else if (S_ISREG(st.st_mode)) {
+            s->entries = (entry_t*)realloc(s->entries,
+                sizeof(entry_t) * (s->count + 1));
+            if (!s->entries)
+                DIE("Out of memory.\n");
+            s->entries[s->count].path = rel;
+            if (hash_file(full, &s->entries[s->count].hash))
+                DIE("Failed to read %s.\n", full);
+            ++s->count;
+        } else
+            free(rel);
+        free(full);
+    }
+    closedir(d);
+    free(dir);
+}
+
+/* Take a snapshot of the regular files under root. */
+snapshot_t snapshot(const char *root) {
+    snapshot_t s = { NULL, 0 };
+
+    walk(root, NULL, &s);
+    qsort(s.entries, s.count, sizeof(entry_t), compare_entries);
+    return s;
+}
+
+void free_snapshot(snapshot_t *s) {
+    size_t i;
+
+    for (i = 0; i < s->count; ++i)
+        free(s->entries[i].path);
+    free(s->entries);
+    s->entries = NULL;
+    s->count = 0;
+}
+
+/* Look up a path in a snapshot. Returns NULL if it is not present. */
+const entry_t *find_entry(const snapshot_t *s, const char *path) {
+    const entry_t key = { (char*)path, 0 };
+
+    return (const entry_t*)bsearch(&key, s->entries, s->count,
+        sizeof(entry_t), compare_entries);
+}
+
+/* Returns 1 if the snapshot's version of the path was produced by a build,
+ * that is it is absent from or differs to the pristine tree.
+ */
+static int produced(const snapshot_t *pristine, const entry_t *e) {
+    const entry_t *orig = find_entry(pristine, e->path);
+    return !orig || orig->hash != e->hash;
+}
+
+/* Add every output that the two builds did not agree on to differences.
+ * The paths belong to the snapshots. Returns the number of differences found.
+ */
+unsigned int compare_outputs(const snapshot_t *pristine,
+        const snapshot_t *a, const snapshot_t *b, strings_t *differences) {
+    size_t i = 0, j = 0, before = differences->count;
+
+    /* Merge the two sorted lists, skipping anything neither build touched. */
+    while (i < a->count || j < b->count) {
+        int c;
+
+        if (i == a->count)
+            c = 1;
+        else if (j == b->count)
+            c = -1;
+        else
+            c = strcmp(a->entries[i].path, b->entries[j].path);
+
+        if (c < 0) {
+            if (produced(pristine, &a->entries[i]))
+                append(differences, a->entries[i].path);
+            ++i;
+        } else if (c > 0) {
+            if (produced(pristine, &b->entries[j]))
+                append(differences, b->entries[j].path);
+            ++j;
+        } else {
+            if (a->entries[i].hash != b->entries[j].hash &&
+                    (produced(pristine, &a->entries[i]) ||
+                     produced(pristine, &b->entries[j])))
+                append(differences, a->entries[i].path);
+            ++i;
+            ++j;
+        }
+    }
+    return (unsigned int)(differences->count - before);
+}
+
@@ -0,0 +1,482 @@
+/* General helpers for libscrutineer.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string.h>
+#include "internal.h"
+
+_Thread_local scrutineer_t *scrutineer_current;
+_Thread_local escape_t *scrutineer_escape;
+
+/* Make the library call in progress fail with the given message, or exit if
+ * there isn't one.
+ */
+void die(const char *format, ...) {
+    scrutineer_t *s = scrutineer_current;
+    escape_t *e = scrutineer_escape;
+    va_list ap;
+    size_t len;
+
+    /* On a worker, leave the rest to the thread it works for. */
+    if (e) {
+        va_start(ap, format);
+        vsnprintf(e->error, sizeof(e->error), format, ap);
+        va_end(ap);
+        len = strlen(e->error);
+        if (len > 0 && e->error[len - 1] == '\n')
+            e->error[len - 1] = '\0';
+        longjmp(e->jmp, 1);
+    }
+
+    /* Whatever went wrong, don't leave the candidates looking changed. */
+    if (s)
+        restore_times(s);
+    va_start(ap, format);
+    if (!s || !s->jmp) {
+        vfprintf(stderr, format, ap);
+        exit(1);
+    }
+    vsnprintf(s->error, sizeof(s->error), format, ap);
+    va_end(ap);
+
+    /* Messages end in a newline for the benefit of stderr, which we don't
+     * want here.
+     */
+    len = strlen(s->error);
+    if (len > 0 && s->error[len - 1] == '\n')
+        s->error[len - 1] = '\0';
+    longjmp(*s->jmp, 1);
+}
+
+/* Report something that looks wrong. Without a progress callback to tell,
+ * this goes to stderr.
+ */
+void warn(const char *format, ...) {
+    scrutineer_t *s = scrutineer_current;
+    char message[1024];
+    size_t len;
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(message, sizeof(message), format, ap);
+    va_end(ap);
+    len = strlen(message);
+    if (len > 0 && message[len - 1] == '\n')
+        message[len - 1] = '\0';
+
+    if (scrutineer_escape && scrutineer_escape->warn)
+        scrutineer_escape->warn(scrutineer_escape->warn_data, message);
+    else if (s && s->on_progress)
+        s->on_progress(s->progress_data, SCRUTINEER_WARNING, NULL, message);
+    else
+        fprintf(stderr, "Warning: %s\n", message);
+}
+
+/* Start a library call, making DIE return to jmp. Returns the previous
+ * context, to be restored when the call finishes.
+ */
+scrutineer_t *enter(scrutineer_t *s, jmp_buf *jmp) {
+    scrutineer_t *saved = scrutineer_current;
+
+    s->jmp = jmp;
+    scrutineer_current = s;
+    return saved;
+}
+
+/* Tell the progress callback about something, if there is one. */
+void progress(scrutineer_t *s, scrutineer_event_t event, const char *target,
+        const char *detail) {
+    if (s->on_progress)
+        s->on_progress(s->progress_data, event, target, detail);
+}
+
+#ifndef _GNU_SOURCE
+/* If _GNU_SOURCE is defined then we will already have strndup from string.h.
+ */
+
+/* Copies at most n characters to a duplicate string. Result is '\0' terminated.
+ */
+char *strndup(const char *s, size_t n) {
+    char *p;
+    size_t i;
+
+    p = (char*)malloc(sizeof(char) * (n + 1));
+    for (i = 0; *s != '\0' && i != n; ++i, ++s)
+        p[i] = *s;
+    p[i] = '\0';
+
+    if (i != n)
+        /* We found a '\0' before the requested n characters. */
+        p = (char*)realloc(p, sizeof(char) * (i + 1));
+
+    return p;
+}
+#endif
+
+static int compare_saved(const void *a, const void *b) {
+    return strcmp(((const saved_times_t*)a)->path,
+        ((const saved_times_t*)b)->path);
+}
+
+/* Sets the modified time of a file. Returns 0 on success or -1 on failure.
+ * If it is a candidate, we note what we set it to so restore_times can tell
+ * whether anyone else has changed it since.
+ */
+int touch(const char *path, const time_t timestamp) {
+    const struct timespec t[2] = { { timestamp, 0 }, { timestamp, 0 } };
+    at_t at = path_at(path);
+    int ret;
+
+    ret = utimensat(at.fd, at.leaf, t, 0);
+    if (ret && errno == ENOENT && path_moved(path, &at))
+        ret = utimensat(at.fd, at.leaf, t, 0);
+    if (ret)
+        return -1;
+    note_stamp(path, timestamp);
+    return 0;
+}
+
+/* Returns 1 if a file exists and 0 otherwise. */
+int exists(const char *path) {
+    at_t at = path_at(path);
+
+    if (!faccessat(at.fd, at.leaf, F_OK, 0))
+        return 1;
+    return errno == ENOENT && path_moved(path, &at) &&
+        !faccessat(at.fd, at.leaf, F_OK, 0);
+}
+
+/* Note that we touched path, if it's a candidate. */
+void note_stamp(const char *path, time_t timestamp) {
+    scrutineer_t *s = scrutineer_current;
+    saved_times_t key, *saved;
+
+    if (!s || !s->saved)
+        return;
+    key.path = path;
+    saved = (saved_times_t*)bsearch(&key, s->saved, s->nsaved,
+        sizeof(saved_times_t), compare_saved);
+    if (saved)
+        saved->stamped = timestamp;
+}
+
+/* Note the candidates' timestamps, to the nanosecond, before we touch any of
+ * them.
+ */
+void save_times(scrutineer_t *s) {
+    saved_times_t *saved;
+    size_t n = 0;
+    list_t *p;
+
+    for (p = s->dependencies; p; p = p->next)
+        ++n;
+    saved = (saved_times_t*)calloc(n ? n : 1, sizeof(saved_times_t));
+    if (!saved)
+        DIE("Out of memory.\n");
+    n = 0;
+    for (p = s->dependencies; p; p = p->next) {
+        struct stat st;
+
+        if (stat(p->value, &st))
+            continue;
+        saved[n].path = p->value;
+        saved[n].times[0] = st.st_atim;
+        saved[n].times[1] = st.st_mtim;
+        ++n;
+    }
+    qsort(saved, n, sizeof(saved_times_t), compare_saved);
+
+    /* Only publish the table once it's complete, in case a signal handler
+     * is about to look at it.
+     */
+    s->nsaved = n;
+    s->saved = saved;
+}
+
+/* Put back the timestamps of the candidates we touched, so the next build
+ * doesn't think they have all changed. Anything modified since we last
+ * touched it is someone else's change and is left alone. This only makes
+ * async-signal-safe calls, so it can be used from a signal handler.
+ */
+void restore_times(scrutineer_t *s) {
+    size_t i;
+
+    for (i = 0; i < s->nsaved; ++i) {
+        saved_times_t *saved = &s->saved[i];
+        struct stat st;
+
+        if (!saved->stamped)
+            continue;
+        /* touch leaves the nanoseconds at 0. */
+        if (!stat(saved->path, &st) && st.st_mtim.tv_sec == saved->stamped &&
+                st.st_mtim.tv_nsec == 0)
+            (void)utimensat(AT_FDCWD, saved->path, saved->times, 0);
+        saved->stamped = 0;
+    }
+}
+
+/* Returns the modified time of a file. */
+time_t get_mtime(const char *path) {
+    struct stat buf;
+    at_t at = path_at(path);
+    int ret;
+
+    ret = fstatat(at.fd, at.leaf, &buf, 0);
+    if (ret && errno == ENOENT && path_moved(path, &at))
+        ret = fstatat(at.fd, at.leaf, &buf, 0);
+    return ret ? (time_t)0 : buf.st_mtime;
+}
+
+/* Add a string to the end of an array. */
+void append(strings_t *v, const char *s) {
+    v->items = (const char**)realloc(v->items, sizeof(char*) * (v->count + 1));
+    if (!v->items)
+        DIE("Out of memory.\n");
+    v->items[v->count++] = s;
+}
+
+/* Returns 1 if an array contains a string and 0 otherwise. */
+int contains(const strings_t *v, const char *s) {
+    size_t i;
+
+    for (i = 0; i < v->count; ++i)
+        if (!strcmp(v->items[i], s))
+            return 1;
+    return 0;
+}
+
+/* Split a string into an array of words terminated by a null entry.
+ */
+char **split(const char *s) {
+    unsigned int i, j;
+    char **parts = NULL;
+    unsigned int sz = 0;
+
+    /* Whether we're inside a singly-quoted string. */
+    int in_s_quote = 0;
+
+    /* Whether we're inside a doubly-quoted string. */
+    int in_d_quote = 0;
+
+    for (i = 0, j = 0; s[i] != '\0'; ++i) {
+
+        /* Find the next space or end of string. */
+        for (j = i; s[j] != '\0' &&
+                   (s[j] != ' ' || in_s_quote || in_d_quote); ++j) {
+            if (s[j] == '\'' && !in_d_quote)
+                in_s_quote = !in_s_quote;
+            else if (s[j] == '\"' && !in_s_quote)
+                in_d_quote = !in_d_quote;
+        }
+
+        if (s[i] == '\'' || s[i] == '\"')
+            /* Jump a leading quote. */
+            ++i;
+
+        if (i != j) {
+            /* Only add this item if we've found something more than a single
+             * space.
+             */
+
+            if (s[j - 1] == '\'' || s[j - 1] == '\"')
+                /* Drop a trailing quote. Note that this check is done after the
+                 * i != j check so that we know we're not reversing i and j in
+                 * the case of a trailing quote on a line. Also this has the
+                 * potentially unexpected behaviour of interpreting unclosed
+                 * quotes as closed by \0.
+                 */
+                --j;
+
+            parts = (char**)realloc(parts, sizeof(char**) * (sz + 1));
+            parts[sz] = strndup(s + i, j - i);
+            ++sz;
+        }
+
+        /* We may need to jump back over a quote that we skipped. */
+        if (s[j] == '\"' || s[j] == '\'') ++j;
+
+        /* If we're at the end of the string setting i=j will cause a buffer
+         * overflow in the next iteration of the loop.
+         */
+        if (s[j] == '\0') break;
+
+        /* Jump the word we've just extracted. */
+        i = j;
+    }
+
+    /* Append NULL. */
+    parts = (char**)realloc(parts, sizeof(char**) * (sz + 1));
+    parts[sz] = NULL;
+
+    return parts;
+}
+
+/* Make room at the end of a split command for a target, whose place is
+ * stored in target_arg.
+ */
+char **with_target(char **argv, unsigned int *target_arg) {
+    for (*target_arg = 0; argv[*target_arg]; ++*target_arg);
+    argv = (char**)realloc(argv, sizeof(char*) * (*target_arg + 2));
+    if (!argv)
+        DIE("Out of memory.\n");
+    argv[*target_arg + 1] = NULL;
+    return argv;
+}
+
+/* Returns a time approximating now that is not the value not. The idea behind
+ * this is that we need a value that is in the future (with respect to not),
+ * but we don't care how far in the future.
+ */
+time_t get_now(time_t not) {
+    time_t ret;
+    while ((ret = time(NULL)) <= not) usleep(100);
+    return ret;
+}
+
+/* Join two path components with a '/'. The caller owns the result. */
+char *join(const char *a, const char *b) {
+    size_t la = strlen(a), lb = strlen(b);
+    char *p;
+
+    p = (char*)malloc(la + lb + 2);
+    if (!p)
+        DIE("Out of memory.\n");
+    memcpy(p, a, la);
+    p[la] = '/';
+    memcpy(p + la + 1, b, lb + 1);
+    return p;
+}
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char *const*)a, *(const char *const*)b);
+}
+
+/* Strip any leading "./" so paths compare equal to the ones we were given. */
+const char *normalise(const char *path) {
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+        while (*path == '/')
+            ++path;
+    }
+    return path;
+}
+
+/* The length of the directory part of path, including the final slash. */
+size_t dir_len(const char *path) {
+    const char *slash = strrchr(path, '/');
+
+    return slash ? (size_t)(slash - path) + 1 : 0;
+}
+
+/* Continue a 64-bit FNV-1a hash over some bytes. Start from HASH_SEED. */
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char*)data;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Files are hashed with xxHash64, which is far faster than FNV-1a as it
+ * keeps four independent lanes of 8 bytes in flight.
+ */
+#define PRIME1 0x9e3779b185ebca87ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+#define PRIME3 0x165667b19e3779f9ULL
+#define PRIME4 0x85ebca77c2b2ae63ULL
+#define PRIME5 0x27d4eb2f165667c5ULL
+#define STRIPE 32
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xx_round(uint64_t acc, uint64_t lane) {
+    return rotl(acc + lane * PRIME2, 31) * PRIME1;
+}
+
+static inline uint64_t xx_merge(uint64_t h, uint64_t acc) {
+    return (h ^ xx_round(0, acc)) * PRIME1 + PRIME4;
+}
+
+/* Hash a file's contents. The result is only meant to be compared with other
+ * hashes from the same run. Returns 0 on success or -1 on failure.
+ */
+int hash_file(const char *path, uint64_t *hash) {
+    unsigned char buf[BUFSIZ * 8];
+    uint64_t acc[4] = {
+        PRIME1 + PRIME2, PRIME2, 0, -PRIME1,
+    };
+    uint64_t h, total = 0;
+    size_t have = 0, i, j;
+    ssize_t r;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    while ((r = read(fd, buf + have, sizeof(buf) - have)) > 0) {
+        total += (uint64_t)r;
+        have += (size_t)r;
+        for (i = 0; i + STRIPE <= have; i += STRIPE)
+            for (j = 0; j < 4; ++j)
+                acc[j] = xx_round(acc[j], read64(buf + i + 8 * j));
+        /* Keep what's short of a whole stripe for next time. */
+        memmove(buf, buf + i, have - i);
+        have -= i;
+    }
+    close(fd);
+    if (r < 0)
+        return -1;
+
+    if (total >= STRIPE) {
+        h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) +
+            rotl(acc[3], 18);
+        for (j = 0; j < 4; ++j)
+            h = xx_merge(h, acc[j]);
+    } else
+        h = PRIME5;
+    h += total;
+
+    /* The tail. */
+    for (i = 0; i + 8 <= have; i += 8)
+        h = rotl(h ^ xx_round(0, read64(buf + i)), 27) * PRIME1 + PRIME4;
+    if (i + 4 <= have) {
+        uint32_t v;
+
+        memcpy(&v, buf + i, sizeof(v));
+        h = rotl(h ^ (uint64_t)v * PRIME1, 23) * PRIME2 + PRIME3;
+        i += 4;
+    }
+    for (; i < have; ++i)
+        h = rotl(h ^ buf[i] * PRIME5, 11) * PRIME1;
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    *hash = h;
+    return 0;
+}
@@ -0,0 +1,180 @@
+/* Watching the build for changes and re-assessing what they affect.
+ *
+ * This code is licensed under a CC BY-SA 3.0 licence. For more information see
+ * the accompanying README.
+ */
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "internal.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+
+/* How long to wait for a burst of file changes to finish, in milliseconds. */
+#define SETTLE_TIME 200
+
+/* Split a path into its directory and the name within it. The caller owns
+ * the directory.
+ */
+static char *dir_of(const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+
+    if (!slash) {
+        *name = path;
+        return strdup(".");
+    }
+    *name = slash + 1;
+    return slash == path ? strdup("/") : strndup(path, slash - path);
+}
+
+/* Tell the edge callback how a target's dependencies changed since old. */
+static void report_delta(scrutineer_t *s, const list_t *p,
+        const strings_t *old) {
+    size_t i;
+
+    if (!s->on_edge)
+        return;
+    for (i = 0; i < p->found.count; ++i)
+        if (!contains(old, p->found.items[i]))
+            s->on_edge(s->edge_data, p->value, p->found.items[i], 1);
+    for (i = 0; i < old->count; ++i)
+        if (!contains(&p->found, old->items[i]))
+            s->on_edge(s->edge_data, p->value, old->items[i], 0);
+}
+
+/* Keep watching the build files and the components for changes, re-probing
+ * the targets each change could affect and reporting how their dependencies
+ * changed. This never returns.
+ */
+void watch(scrutineer_t *s) {
+    strings_t dirs = { NULL, 0 }, watched = { NULL, 0 };
+    int fd, *wds = NULL;
+    list_t *p, *p1;
+    size_t i;
+
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+        DIE("Failed to initialise inotify.\n");
+
+    /* Watch the directory of every file we care about rather than the files
+     * themselves, as editors often replace a file instead of writing to it.
+     */
+    for (p1 = s->dependencies; p1; p1 = p1->next)
+        append(&watched, normalise(p1->value));
+    for (i = 0; i < s->makefiles.count; ++i)
+        append(&watched, normalise(s->makefiles.items[i]));
+    for (i = 0; i < watched.count; ++i) {
+        const char *name;
+        char *dir = dir_of(watched.items[i], &name);
+
+        if (contains(&dirs, dir)) {
+            free(dir);
+            continue;
+        }
+        wds = (int*)realloc(wds, sizeof(int) * (dirs.count + 1));
+        if (!wds)
+            DIE("Out of memory.\n");
+        wds[dirs.count] = inotify_add_watch(fd, dir,
+            IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_DELETE);
+        if (wds[dirs.count] < 0)
+            DIE("Failed to watch %s.\n", dir);
+        append(&dirs, dir);
+    }
+
+    /* Remember the rules each target was assessed with. */
+    if (s->backend->fingerprint)
+        for (p = s->targets; p; p = p->next)
+            p->fingerprint = s->backend->fingerprint(s->build,
+                s->target_arg, p->value);
+
+    for (;;) {
+        strings_t changed = { NULL, 0 };
+        int makefile_changed = 0, timeout = -1;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        /* Wait for something to change, then for things to settle. */
+        while (poll(&pfd, 1, timeout) > 0) {
+            union {
+                struct inotify_event event;
+                char raw[sizeof(struct inotify_event) + NAME_MAX + 1];
+            } buf;
+            ssize_t len = read(fd, &buf, sizeof(buf));
+            const struct inotify_event *e;
+            char *q;
+
+            if (len <= 0)
+                break;
+            for (q = buf.raw; q < buf.raw + len; q += sizeof(*e) + e->len) {
+                const char *path;
+                size_t j;
+
+                e = (const struct inotify_event*)q;
+                if (!e->len)
+                    continue;
+                for (j = 0; j < dirs.count && wds[j] != e->wd; ++j);
+                if (j == dirs.count)
+                    continue;
+                path = strcmp(dirs.items[j], ".") ?
+                    join(dirs.items[j], e->name) : strdup(e->name);
+                if (contains(&watched, path) && !contains(&changed, path))
+                    append(&changed, path);
+                else
+                    free((char*)path);
+            }
+            timeout = SETTLE_TIME;
+        }
+
+        for (i = 0; i < changed.count; ++i) {
+            size_t j;
+            for (j = 0; j < s->makefiles.count; ++j)
+                if (!strcmp(changed.items[i],
+                        normalise(s->makefiles.items[j])))
+                    makefile_changed = 1;
+        }
+
+        for (p = s->targets; p; p = p->next) {
+            strings_t old;
+            int affected = 0;
+
+            /* A target is affected if one of its dependencies changed or,
+             * when the build files changed, if its rules did.
+             */
+            for (i = 0; !affected && i < p->found.count; ++i)
+                affected = contains(&changed, normalise(p->found.items[i]));
+            if (makefile_changed) {
+                uint64_t fp = s->backend->fingerprint ?
+                    s->backend->fingerprint(s->build, s->target_arg,
+                        p->value) : 0;
+                if (!fp || fp != p->fingerprint || p->phony || p->dirty ||
+                        p->failed)
+                    affected = 1;
+                p->fingerprint = fp;
+            }
+            if (!affected)
+                continue;
+
+            /* Keep the old results from being freed until we've compared. */
+            old = p->found;
+            p->found.items = NULL;
+            p->found.count = 0;
+            progress(s, SCRUTINEER_TARGET_START, p->value, NULL);
+            s->quiet = 1;
+            examine(s, p, s->dependencies);
+            s->quiet = 0;
+            report_delta(s, p, &old);
+            progress(s, SCRUTINEER_TARGET_DONE, p->value, NULL);
+            free(old.items);
+        }
+        write_profile(s);
+
+        for (i = 0; i < changed.count; ++i)
+            free((char*)changed.items[i]);
+        free(changed.items);
+    }
+}
+#endif
+